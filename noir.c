@@ -7,7 +7,13 @@
    ncurses or some equivalent is required for this version
 
    compiles on most machines using some variant of:
-   % gcc noir.c -o noir -Wall -lcurses
+   % gcc noir.c -o noir -Wall -lcurses -lpthread
+
+   or, to draw straight to a VT100/xterm style terminal without ncurses:
+   % gcc noir.c -o noir -Wall -D_VT_DISPLAY -lpthread
+
+   tests/draw_allocs.c checks that redrawing the screen doesn't allocate; how to build and run
+   it is at the top of it
 
    just drop the compiled binary into your /bin/ folder to use "noir" on the command line
    don't forget to change permissions, eg.
@@ -22,13 +28,20 @@
         and including the headers for your library/platform
    - comment out #include <curses.h> (ncurses library header) and #include <signal.h> (header
         for linux-specific SIGWINCH functionality)
+   - load_file() maps the file with the unix mmap() call, falling back to read(); replace
+        both with fread() of the whole file if neither is available
    - remove the sighandler typedef if you're not using #include <signal.h> anymore
    - adjust the values for keyboard constant #define's to match your platform/library;
         this is the most time-consuming part on most occasions
    - if you aren't using linux, you'll need to remove the SIGWINCH call from the
         _display_init() function; if you want to retain resize capture functionality,
         you'll need to find a platform-specific method of capturing resize events
-   - adjust the get_input() function if your keyboard input library is different
+   - adjust the poll_input() function if your keyboard input library is different;
+        get_input() sleeps in poll() on stdin and a pipe that background threads and
+        the resize handler write to, so it wants input that can be polled the same way
+   - or compile with -D_VT_DISPLAY: the display and keyboard functions then talk to a
+        VT100/xterm style terminal directly, with termios and escape sequences, writing
+        each frame out in a single write(); ncurses isn't needed at all
    - adjust the following display library front-end functions to call
         the equivalent functions from your library:
 
@@ -45,14 +58,9 @@
 
    ----- <THINGS LEFT TO DO> -----------------------------------------------------------------
 
-   - write function for catching quit event and dump the buffer to a file (platform-
-        specific)
    - smart bracing/tabbing
    - backspace multiple times to erase line for backspace+shift/ctrl functionality
    - other misc. functionality (check reserved key #def's)
-   - for undo, push each character action or delete action onto stack, view it
-        and reverse to undo; do not pop them off completely until a new action
-        is taken etc.
 
    ----- <README> ----------------------------------------------------------------------------
 
@@ -85,6 +93,15 @@
          command line; noir will confirm the creation of a new file. If you do not save
          the buffer in the new file before you quit, and you confirm that you do not
          want to save, the file will not be created.
+       - Large files are loaded on one thread per processor core; "noir -j 2 filename"
+         limits loading (and replacing) to two threads. The time the load took is shown on
+         the bottom line.
+         The first screen of a large file comes up right away and the rest of it loads in
+         the background, the bottom line showing how far along it is.
+       - "noir -R filename" only views the file: it is mapped into memory and drawn from
+         there, so even very large files take memory only for the index of their lines.
+       - "noir -P filename" edits the file the same way: lines are only copied into memory
+         once they are changed.
        - If you type "noir" without a command line argument, noir will assume you
          are editing the default file "_bufdump". In this situation, your changes will
          be saved automatically upon exit.
@@ -92,6 +109,35 @@
          want to save. If you type 'N' or 'n', the current buffer will still be saved
          to the file "_bufdump" in your current working directory. If you type 'Y' or 'y'
          the buffer will be saved to the last file you listed on the command line.
+       - Saving is done in the background, so you can keep typing; "saving..." shows on
+         the bottom line until it's done. The file is written next to the old one and only
+         renamed over it once it's safely on disk. Lines not changed since the file was
+         loaded are copied across from it by the system, not written out again; if only a
+         few characters changed and nothing moved, just those are written over the file.
+       - Every edit is noted in a journal next to the file ("filename.noir#"), written out
+         whenever you stop typing. If noir is killed before you save, opening the file again
+         makes the lost edits over again; the bottom line says so. Saving starts the journal
+         over, and it goes once you quit.
+       - Ctrl-Z undoes the last edit, Ctrl-A redoes it. A run of typing or backspacing is
+         undone in one go, as is a whole cut or paste. "noir -u 16 filename" keeps 16 MB
+         of undo history instead of 64, the oldest going first.
+       - Ctrl-F asks for text to find and moves the cursor to where it next is, going
+         round to the start of the buffer past the end; just enter finds the same text
+         again. Ctrl-G finds it before the cursor. A long search shows how far it got and
+         how fast on the bottom line, and any key stops it.
+       - Ctrl-H asks for a line number and goes straight to it, however far.
+       - Ctrl-R asks for text to replace (just enter for the text last found) and what to
+         replace it with, then replaces it everywhere in the buffer, on a thread per core.
+         How many were replaced and how long it took is shown on the bottom line, and
+         Ctrl-Z undoes the lot.
+       - "noir -t filename" indexes the trigrams (every 3 characters in a row) of each block
+         of 64 lines as it loads, about 11% on top of the file, and finds and replaces pass
+         over blocks that can't hold the text. The index is saved next to the file
+         ("filename.noir3") and read back the next time as long as the file hasn't changed.
+       - Ctrl-E asks for a regex to find after the cursor: characters, '.', [classes],
+         \d \w \s (and \D \W \S), ^ and $ for the line start and end, (groups), a|b, and
+         * + ? {m,n} repeats, the longest of the leftmost matches found. Ctrl-W counts the
+         matches all through the buffer on a thread per core, listing the first few lines.
 
 
       What's going on...
@@ -136,7 +182,7 @@
              sel-             ... the first coordinate has been selected, awaiting second
              sel-single       ... you have a single-line stretch of text selected
              sel-multi.       ... you have multiple lines selected
-      (4) The line numbers are displayed on left. Resets to 0 when 1,000,000 is reached.
+      (4) The line numbers are displayed on left. The column widens past 999,999.
       (5) The ascii code of the last keypress is displayed. Useful for adjusting keycode
              constants, among other uses.
 
@@ -150,12 +196,35 @@
 ***********************************************************************************************************/
 
 
+#define _GNU_SOURCE         //for copy_file_range
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
+#ifndef _VT_DISPLAY
 #include <curses.h>        //if you can't find this in your includes, install ncurses
+#else
+#include <termios.h>       //the terminal is driven directly instead
+#include <errno.h>
+#include <sys/ioctl.h>
+#endif
 #include <signal.h>        //this one's only going to work in unix/linux
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>         //unix file access for fast loading and saving
+#include <unistd.h>
+#include <poll.h>          //sleeping on keys and background work together
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>           //for loading large files on several threads
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_SCAN_SCALAR)
+#define    _SCAN_SIMD                            //vector scanning kernels, picked at runtime;
+#include <immintrin.h>                           //compile with -D_SCAN_SCALAR to do without
+#endif
 
 
 #ifndef    ERR
@@ -165,27 +234,79 @@
 #define    TRUE               1
 #define    FALSE              0
 
-#define    _MAX_LINES         1000
+#define    _BLK_LINES         64                 //lines held per block of the line tree
+
+#define    _SHARE_FILE        1                  //line text still in the mapped file
+#define    _SHARE_SAVE        2                  //line text still in a snapshot being saved
 
 #define    _MD_OPEN           111
 #define    _MD_NEW            112
 #define    _MD_QUIT           113
 #define    _MD_BUF            114
 
+#define    _SV_CHECK          121                //saving passes: see what can be saved in place,
+#define    _SV_PATCH          122                //write only the edited text over the file,
+#define    _SV_WRITE          123                //or write a whole new file
+
+#define    _JN_ADD            'a'                //edits as journaled: line, offset, character
+#define    _JN_DEL            'd'                //line, offset
+#define    _JN_SPLIT          's'                //line, offset
+#define    _JN_JOIN           'j'                //line
+#define    _JN_BLANK          'b'                //line
+#define    _JN_TEXT           't'                //line, offset, length, text
+#define    _JN_RANGE          'r'                //line, offset to line, offset
+
+#define    _UN_INS            1                  //undo records: text put in,
+#define    _UN_DEL            2                  //text taken out,
+#define    _UN_BKS            3                  //text backspaced out, kept backwards
+
+#define    _FD_NONE           0                  //finding: nothing found,
+#define    _FD_FOUND          1                  //found it,
+#define    _FD_WRAPPED        2                  //found it after going round the buffer end,
+#define    _FD_STOPPED        3                  //or stopped by a key
+
+#define    _RE_SET            1                  //regex states: a character of a set,
+#define    _RE_BOL            2                  //the start of the line,
+#define    _RE_EOL            3                  //the end of the line,
+#define    _RE_SPLIT          4                  //going on both ways,
+#define    _RE_EMPTY          5                  //going on,
+#define    _RE_MATCH          6                  //or the end of a match
+
 #define    _BUFDUMP           "_bufdump"         //default save buffer/open buffer file
 #define    _ENDCHAR           '~'                //character to display as endline
 #define    _TAB_LEN           3                  //number of spaces equaling one tab
+#define    _SCAN_WINDOW       65536              //bytes scanned for newlines at a time
+#define    _LOAD_SHARE        (1 << 20)          //bytes a loading or replacing thread gets at least
+#define    _LOAD_FIRST        1024               //lines loaded before the first screen...
+#define    _LOAD_BATCH        (16 << 20)         //...the rest loading behind it in batches
+#define    _SAVE_STAGE        (1 << 20)          //bytes of lines gathered per write when saving...
+#define    _SAVE_DIRECT       4096               //...lines this long are written where they are
+#define    _SAVE_PATCH        (1 << 20)          //most edited bytes written over a file in place
+#define    _JNL_BATCH         (64 << 10)         //bytes of edits gathered before journaling them
+#define    _JNL_HEAD          40                 //bytes of journal header, naming the file version
+#define    _JNL_MAGIC         "noirjnl1"
+#define    _UNDO_CHUNK        (64 << 10)         //bytes of undo history allocated at a time
+#define    _UNDO_CAP          64                 //megabytes of undo history kept by default
+#define    _FIND_LEN          80                 //longest text to find
+#define    _FIND_SLICE        (8 << 20)          //bytes searched between looks at the clock...
+#define    _FIND_QUIET        0.25               //...and seconds before a search shows how it goes
+#define    _RE_STATES         20000              //most states a regex compiles to
+#define    _RE_DFA_STATES     2048               //states of a regex's DFA kept before starting over
+#define    _RE_LIST           8                  //matches listed when counting them
+#define    _TRI_SIZE          512                //bytes of trigram bits per block of lines, 2^12 bits
+#define    _TRI_HEAD          (5 * sizeof(long)) //saved index: magic, file size and time, _TRI_SIZE...
+#define    _TRI_MAGIC         0x7864693372696f6eL //...then where each block is, its size and its bits
 
 //Keyboard
 
 #define    _KB_SHFT_BKS       8                  //kill everything on line to left    *
 #define    _KB_CTRL_UDRSCR    31                 //kill everythingon line to right    *
 #define    _KB_CTRL_T         20                 //time                               *
-#define    _KB_CTRL_H         8                  //goto                               *
-#define    _KB_CTRL_F         6                  //find                               *
-#define    _KB_CTRL_R         18                 //replace                            *
-#define    _KB_CTRL_Z         26                 //undo                               *
-#define    _KB_CTRL_A         1                  //redo                               *
+#define    _KB_CTRL_H         8                  //goto line
+#define    _KB_CTRL_F         6                  //find
+#define    _KB_CTRL_R         18                 //replace all
+#define    _KB_CTRL_Z         26                 //undo
+#define    _KB_CTRL_A         1                  //redo
 
 #define    _KB_ENT_N          '\n'               //catch both just in case
 #define    _KB_TB             '\t'               //tab key
@@ -195,10 +316,10 @@
 #define    _KB_CTRL_X         24                 //cut
 #define    _KB_CTRL_V         22                 //paste
 
-#define    _KB_CTRL_W         23                 //
-#define    _KB_CTRL_E         5                  //
+#define    _KB_CTRL_W         23                 //count regex
+#define    _KB_CTRL_E         5                  //find regex
 #define    _KB_CTRL_Y         25                 //
-#define    _KB_CTRL_G         7                  //
+#define    _KB_CTRL_G         7                  //find backwards
 #define    _KB_CTRL_Q         17                 //quit
 #define    _KB_CTRL_S         19                 //save buffer to file
 #define    _KB_CTRL_C         3                  //quit
@@ -211,6 +332,19 @@
 
 #define    _KB_F06            270                //quit
 
+#ifdef     _VT_DISPLAY                           //the codes ncurses has for the keys, the
+#define    KEY_DOWN           0402               //escape sequences are decoded to them
+#define    KEY_UP             0403
+#define    KEY_LEFT           0404
+#define    KEY_RIGHT          0405
+#define    KEY_HOME           0406
+#define    KEY_BACKSPACE      0407
+#define    KEY_NPAGE          0522
+#define    KEY_PPAGE          0523
+#define    KEY_ENTER          0527
+#define    KEY_END            0550
+#endif
+
 #define    _KB_UP             KEY_UP             //cursor control  - up               %
 #define    _KB_DN             KEY_DOWN           //cursor control  - down             %
 #define    _KB_LF             KEY_LEFT           //cursor control  - left             %
@@ -223,6 +357,12 @@
 #define    _KB_BKS            KEY_BACKSPACE      //backspace                          %
 #define    _KB_ENT            KEY_ENTER          //newline etc.                       %
 
+#define    _KB_EVENT          -2                 //not a key, background work needs attention
+#define    _INPUT_WAIT        10                 //ms without a key before background work is done
+#define    _ESC_WAIT          25                 //ms after escape for the rest of a key
+#define    _VT_OUT            65536              //bytes first set aside for a frame
+#define    _SPAN_GAP          8                  //unchanged characters worth moving past
+
 //                                                                           *not done
 //                                                                           %platform
 
@@ -231,6 +371,67 @@
 
 typedef __sighandler_t _handle;      //specific to signal.h
 
+typedef struct                       //a line of text, kept as a gap buffer so that
+{                                    //typing at the cursor does not copy the line
+   char *txt;                        //the text, with the gap at the last edit position
+   int len;                          //number of characters of text on the line
+   int gap;                          //offset of the gap in txt
+   int gap_len;                      //size of the gap
+   int shared;                       //txt is the file's or a snapshot's, not ours to change
+   long orig;                        //where the line is in the file as loaded, -1 once edited
+} _line;
+
+typedef struct _line_blk             //block of consecutive lines; the blocks form a treap
+{                                    //ordered by line number, a balanced rope of lines
+   struct _line_blk *lf;             //blocks holding the lines before this block
+   struct _line_blk *rt;             //blocks holding the lines after this block
+   unsigned int pri;                 //random heap priority, keeps the tree balanced
+   long n_lines;                     //number of lines in this subtree
+   long n_bytes;                     //bytes in this subtree, a newline counted per line
+   long bytes;                       //bytes in this block
+   int count;                        //number of lines in this block
+   long gen;                         //generation, blocks no newer than a snapshot are frozen
+   long orig;                        //where the lines are in the file if all are unedited and
+                                     //still in order there, else -1
+   unsigned char *tri;               //trigrams in the lines, a bit each, NULL if not indexed
+   unsigned long long tri_dirty;     //lines edited since, a bit each, to add in before use
+   _line line[_BLK_LINES];
+} _line_blk;
+
+typedef struct                       //loading the rest of a file in the background
+{
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t more;              //signalled when another batch of lines is ready
+   char *data;                       //the file being loaded
+   long size;
+   int mapped;
+   int kept;                         //the file is kept open, where lines are in it is kept
+   long done;                        //bytes of it loaded so far
+   int finished;                     //the loading thread is done
+   int threads;                      //threads used per batch
+   _line_blk *lines;                 //lines loaded but not yet attached to the buffer
+   double start;
+} _loader;
+
+typedef struct                       //the text buffer
+{
+   _line_blk *root;
+   _loader *loading;                 //the rest of the file still loading, if it is
+   struct _saver *saving;            //a save still being written, if there is one
+   long changes;                     //edits made to the buffer so far
+   _line_blk *hint;                  //block of the last line looked up, so repeated
+   long hint_start;                  //lookups near the cursor skip the tree walk
+   char *file;                       //the file shared lines point into, kept while they do
+   long file_size;
+   int file_mapped;
+   int base;                         //the file as loaded, unedited lines are copied from it
+   long base_size;                   //when saving
+   struct timespec base_time;        //when it was last changed, if it has been since it's no use
+   struct _journal *journal;         //where edits are noted, NULL if they aren't
+   struct _undo *undo;               //edits that can be undone, NULL if they can't
+} _txt_buf;
+
 typedef struct                       //for cursor management
 {
    int x;                            //cursor position on screen display
@@ -243,7 +444,7 @@ typedef struct                       //for cursor management
    int buf_y;
    int cushion;                      //horizontal cushion
 
-   char *clip;                       //clipboard/cursor properties
+   _line clip;                       //clipboard/cursor properties
    int clip_type;
    int data_type;
    int clip_lf_off;                  //clip selection coordinates
@@ -252,41 +453,406 @@ typedef struct                       //for cursor management
    long clip_bt_off;
 } _cursor_inst;
 
+typedef struct                       //a loading thread's share of a file
+{
+   char *data;                       //the whole file
+   long at;                          //where data is in the file on disk, or -1
+   long from;                        //bytes to scan for newlines
+   long to;
+   long *nl;                         //offsets of the newlines found
+   long count;
+   long *ends;                       //offsets where the lines of the file end
+   long first;                       //lines to build
+   long last;
+   _txt_buf lines;                   //the lines built
+} _load_job;
+
+typedef struct                       //lines gathered up for writing out in one go
+{
+   int fd;
+   int pass;                         //_SV_CHECK, _SV_PATCH or _SV_WRITE
+   int base;                         //the file as loaded, unedited text is copied from it
+   long base_size;
+   int fits;                         //checking: all unedited text is still where it was
+   long at;                          //where in the file the next text goes
+   char *stage;                      //the text of the lines gathered so far
+   long staged;
+   long run_from;                    //unedited text still to be copied from the base
+   long run_len;
+   long lines;                       //lines still to go, the last gets no newline
+   long bytes;                       //bytes written so far
+   long copied;                      //bytes copied from the base so far
+   int error;
+} _save_batch;
+
+typedef struct _saver                //saving a snapshot of the buffer in the background
+{
+   pthread_t thread;
+   pthread_mutex_t lock;
+   int threaded;                     //FALSE if it was saved without a thread of its own
+   int finished;                     //the saving thread is done
+   _line_blk *root;                  //the snapshot, frozen until the save is done
+   char *filename;
+   char *target;                     //filename with any links followed, the file replaced
+   char *path;                       //temporary file written, then renamed over target,
+                                     //NULL if filename is patched in place
+   char *dir;                        //the directory they're in
+   _save_batch batch;
+   long changes;                     //edits to the buffer when the snapshot was taken
+   double start;
+} _saver;
+
+typedef struct _undo_chunk           //a piece of the undo arena, records one after another
+{
+   struct _undo_chunk *prev;
+   struct _undo_chunk *next;
+   long size;
+   long used;
+   char mem[];
+} _undo_chunk;
+
+typedef struct _undo_rec             //an edit as it can be undone: text put in or taken out
+{
+   struct _undo_rec *prev;           //the edit before it
+   _undo_chunk *chunk;               //the chunk it's in...
+   long size;                        //...and the bytes it takes there
+   long step;                        //the edits made for one key are undone together
+   int kind;                         //_UN_INS, _UN_DEL or _UN_BKS
+   int typing;                       //made by typing, runs of it make one record
+   long n;                           //where the text starts...
+   int offset;
+   long n2;                          //...and where it ends
+   int offset2;
+   long len;
+   char txt[];
+} _undo_rec;
+
+typedef struct _undo                 //edits that can be undone, and those undone to redo
+{
+   _undo_chunk *first;               //the arena, oldest records first
+   _undo_chunk *last;
+   _undo_rec *top;                   //last edit not undone, NULL if none
+   long bytes;                       //held by the arena
+   long steps;                       //keys edits were made for so far
+   long step;                        //the key edits are being made for now
+   int typing;
+   long floor;                       //steps up to this are partly forgotten, can't be undone
+   int applying;                     //undoing or redoing, edits aren't noted
+} _undo;
+
+typedef struct                       //a state of a compiled regex; together they're an NFA
+{
+   int op;                           //_RE_
+   int set;                          //the characters it matches, for _RE_SET
+   int out;                          //the states it goes on to, -1 for none
+   int out1;
+} _re_state;
+
+typedef struct                       //a compiled regex
+{
+   _re_state *state;
+   int n_states;
+   int max_states;
+   unsigned char (*set)[32];         //sets of characters, a bit each
+   int n_sets;
+   int max_sets;
+   int start;
+   unsigned char cls[256];           //characters no set tells apart are of a class,
+   unsigned char rep[256];           //each class with a character standing for it
+   int n_cls;
+   char lit[_FIND_LEN];              //text every match starts with, looked for first
+   int lit_len;
+   char *err;                        //why it didn't compile, NULL if it did
+} _regex;
+
+typedef struct                       //a DFA built from a regex as it runs, each state of
+{                                    //it a set of the regex's states
+   _regex *re;
+   int anchored;                     //matches start where it starts, else anywhere after
+   int width;                        //transitions per state: the classes, line start and end
+   int n_states;
+   int max_states;
+   int *next;                        //transitions, -1 until first taken
+   char *accept;                     //states a match ends in
+   long *at;                         //where the set of each state is in pool
+   int *len;
+   int *pool;
+   long pool_used;
+   long pool_size;
+   int *hash;                        //states by their set
+   int hash_size;
+   int start;                        //-1 until built
+   int *work;                        //building a set, regex states marked as they're added
+   int *stack;
+   int *mark;
+   int gen;
+} _dfa;
+
+typedef struct                       //running a regex: one DFA finds where the first match
+{                                    //ends, the other how far a match from a start goes
+   _dfa find;
+   _dfa match;
+} _re_scan;
+
+typedef struct                       //a match
+{
+   long n;
+   int offset;
+   int len;
+} _re_match;
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////
+typedef struct                       //a search through the buffer
+{
+   char *txt;                        //what's being looked for
+   int len;
+   int back;                         //looking backwards from the cursor
+   char *flat;                       //a line with its gap in the middle, put back together
+   int flat_size;
+   long scanned;                     //bytes looked through so far
+   long next_check;
+   double start;
+   _cursor_inst *cursor;             //where to show how it's going, NULL not to
+   _re_scan *re;                     //the regex looked for instead of the text, if there is one
+} _finder;
+
+typedef struct                       //a line rebuilt with the text replaced in it
+{
+   long n;
+   char *txt;
+   int len;
+} _new_line;
+
+typedef struct                       //a replacing thread's share of the buffer
+{
+   _txt_buf *txt_buf;
+   _line_blk **blks;                 //the blocks of lines, in order...
+   long *starts;                     //...and the line each starts at
+   long first;                       //blocks to replace in
+   long last;
+   _finder fd;                       //the text replaced
+   char *with;                       //and what replaces it
+   int with_len;
+   long *at;                         //where it is in a line
+   long at_size;
+   _new_line *lines;                 //the lines rebuilt
+   long count;
+   long size;
+   long found;                       //replacements made
+} _replace_job;
+
+typedef struct                       //a regex counting thread's share of the buffer
+{
+   _line_blk **blks;
+   long *starts;
+   long first;
+   long last;
+   _finder fd;
+   _re_scan rs;
+   _re_match list[_RE_LIST];         //the first matches
+   long found;                       //matches
+   long lines;                       //lines they're on
+} _regex_job;
+
+typedef struct _journal              //edits since the last save, to get back after a crash
+{
+   int fd;
+   char *path;
+   char *filename;                   //the file they're edits to
+   char *batch;                      //edits not yet written out
+   int used;
+   long size;                        //bytes written out so far
+   long saved_at;                    //where the edits made since the snapshot being saved start
+} _journal;
 
 
-char *init_new_line();
-char **init_ptr_buf(int n);
-char ***init_txt_buf();
-void init_blank_lines(char ***txt_buf, int k, int j);
-void init_null_sections(char ***txt_buf, int k, int j);
+////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-char *del_char_from_line(char *old, int offset, int curlen);
-char *add_char_to_line(char *old, char add, int offset, int curlen);
-char *add_char_to_line_end(char *old, char add, int offset, int curlen);
 
-long num_lines(char ***txt_buf);
+_line init_new_line();
+void free_line(_line *ln);
+void own_line(_line *ln);
+void retire(void *mem);
+_line_blk *init_line_blk();
+_txt_buf *init_txt_buf();
+void init_blank_lines(_txt_buf *txt_buf, long n);
+void free_line_blks(_line_blk *blk);
+void drop_line_blks(_line_blk *blk);
+void append_line_blk(_txt_buf *txt_buf, _line_blk *blk);
+
+void update_line_blk(_line_blk *blk);
+_line_blk *merge_line_blks(_line_blk *a, _line_blk *b);
+void split_line_blks(_line_blk *blk, long n, _line_blk **a, _line_blk **b);
+long line_blk_orig(_line_blk *blk);
+_line_blk *find_line_blk(_line_blk *blk, long n, int *i);
+void count_line_blks(_line_blk **link, long n, int d_lines, long d_bytes);
+
+_line_blk *find_buf_line(_txt_buf *txt_buf, long n, int *i);
+_line_blk *edit_buf_line(_txt_buf *txt_buf, long n, int *i);
+_line_blk *thaw_line_blk(_line_blk *blk);
+void thaw_lines(_line_blk *blk);
+_line *get_line(_txt_buf *txt_buf, long n);
+_line *edit_line(_txt_buf *txt_buf, long n);
+void insert_line(_txt_buf *txt_buf, long n, _line ln);
+void remove_line(_txt_buf *txt_buf, long n);
+long line_offset(_txt_buf *txt_buf, long n);
+long offset_line(_txt_buf *txt_buf, long offset);
+
+void buf_add_char(_txt_buf *txt_buf, long n, int offset, char add);
+void buf_del_char(_txt_buf *txt_buf, long n, int offset);
+void buf_split_line(_txt_buf *txt_buf, long n, int offset);
+void buf_join_lines(_txt_buf *txt_buf, long n);
+void buf_insert_text(_txt_buf *txt_buf, long n, int offset, char *txt, long len);
+void buf_delete_range(_txt_buf *txt_buf, long n, int offset, long n2, int offset2);
+void buf_replace_line(_txt_buf *txt_buf, long n, char *txt, int len);
+_line buf_extract_range(_txt_buf *txt_buf, long n, int offset, long n2, int offset2);
+long copy_range_text(_txt_buf *txt_buf, long n, int offset, long n2, int offset2, char *dst);
+
+void move_line_gap(_line *ln, int offset);
+void grow_line(_line *ln, int n);
+void del_char_from_line(_line *ln, int offset);
+void add_char_to_line(_line *ln, char add, int offset);
+void add_char_to_line_end(_line *ln, char add, int offset);
+void join_lines(_line *ln, _line *next);
+void add_text_to_line(_line *ln, char *txt, int n, int offset);
+_line init_text_line(char *txt, int n);
+_line split_line(_line *ln, int offset);
+char line_char(_line *ln, int i);
+int copy_line_text(_line *ln, int from, int n, char *dst);
+
+long num_lines(_txt_buf *txt_buf);
 int alphanum(int ch);
-
-int parse_input(int c, char **v);
-void load_file(char ***txt_buf, char *filename);
-int save_file(char ***txt_buf, char *filename, int saved, int exiting);
+int copy_sanitized(char *dst, char *src, long n);
+int find_newlines(char *src, int n, int *pos);
+long find_text(char *src, long n, char *txt, int len);
+long find_last_text(char *src, long n, char *txt, int len);
+void init_scan_kernels();
+double get_time();
+
+int parse_input(int c, char **v, char **open_file);
+void load_file(_txt_buf *txt_buf, char *filename);
+int load_lines(_txt_buf *txt_buf, char *data, long size, long at);
+void release_file(_txt_buf *txt_buf);
+void run_jobs(void *jobs, int n, int size, void *(*work)(void *));
+void *scan_load_job(void *job);
+void *build_load_job(void *job);
+void *load_rest(void *loader);
+int attach_loaded_lines(_txt_buf *txt_buf);
+void wait_for_lines(_txt_buf *txt_buf, long n);
+_line_blk *load_line(_txt_buf *txt_buf, _line_blk *blk, char *src, long len, long orig);
+_line_blk *append_line(_txt_buf *txt_buf, _line_blk *blk, _line ln);
+int save_file(_txt_buf *txt_buf, char *filename, int saved, int exiting);
+_saver *start_save(_txt_buf *txt_buf, char *filename);
+void *write_snapshot(void *saver);
+int finish_save(_txt_buf *txt_buf, int wait);
+void save_line_blks(_line_blk *blk, _save_batch *sv);
+void save_text(_save_batch *sv, _line *ln, int nl);
+void save_span(_save_batch *sv, long from, long len);
+void flush_save_batch(_save_batch *sv, _line *ln);
+void flush_save_run(_save_batch *sv);
+void open_journal(_txt_buf *txt_buf, char *filename);
+long replay_journal(_txt_buf *txt_buf, unsigned char *rec, long size);
+void journal_head(char *head, char *filename);
+void journal_edit(_txt_buf *txt_buf, int op, long n, long offset, int ch);
+void journal_text(_txt_buf *txt_buf, long n, long offset, char *txt, long len);
+void journal_range(_txt_buf *txt_buf, long n, long offset, long n2, long offset2);
+int journal_arity(int op);
+char *journal_args(_journal *jn, int op, long *arg, int k);
+void flush_journal(_journal *jn);
+void restart_journal(_txt_buf *txt_buf, char *filename);
+void close_journal(_txt_buf *txt_buf);
+_undo *init_undo();
+void undo_step(_txt_buf *txt_buf, int typing);
+void note_undo(_txt_buf *txt_buf, int kind, long n, int offset, char *txt, long len);
+void note_undo_range(_txt_buf *txt_buf, long n, int offset, long n2, int offset2);
+_undo_rec *add_undo_rec(_undo *u, long len);
+_undo_rec *grow_undo_rec(_undo *u, long len);
+_undo_rec *next_undo_rec(_undo *u, _undo_rec *rec);
+_undo_chunk *add_undo_chunk(_undo *u, long size);
+void forget_undo(_undo *u);
+void trim_undo(_undo *u);
+void text_end(long n, int offset, char *txt, long len, long *n2, int *offset2);
+int undo_edits(_txt_buf *txt_buf, int redo, long *n, int *offset);
+int find_in_buf(_txt_buf *txt_buf, _finder *fd, long *n, int *offset);
+int find_in_line_blk(_txt_buf *txt_buf, _finder *fd, _line_blk *blk, int k, long from, int *at);
+char *flat_line_text(_finder *fd, _line *ln);
+int find_going(_finder *fd);
+void index_line_blk(_line_blk *blk);
+void add_trigrams(unsigned char *tri, _line *ln);
+int may_hold_text(_line_blk *blk, char *txt, int len);
+void open_trigrams(char *filename, struct stat *st);
+void save_trigrams(_line_blk *blk);
+void close_trigrams(_txt_buf *txt_buf);
+long count_trigrams(_line_blk *blk);
+long replace_in_buf(_txt_buf *txt_buf, char *txt, char *with, long *lines, int *threads);
+int share_line_blks(_txt_buf *txt_buf, _line_blk ***blks, long **starts, long *count);
+long list_line_blks(_line_blk *blk, _line_blk **blks, long *starts, long k, long *n);
+void *replace_job(void *job);
+void replace_in_line(_replace_job *jb, _line *ln, long n);
+_regex *compile_regex(char *pat);
+void free_regex(_regex *re);
+int re_alt(_regex *re, char **p, int *tail);
+int re_concat(_regex *re, char **p, int *tail);
+int re_repeat(_regex *re, char **p, int *tail);
+int re_loop(_regex *re, int start, int *tail, int optional, int again);
+int re_atom(_regex *re, char **p, int *tail);
+int re_class(_regex *re, char **p, unsigned char *set);
+void re_escape(unsigned char *set, int c);
+int re_add_state(_regex *re, int op, int set);
+int re_add_set(_regex *re);
+void re_patch(_regex *re, int list, int to);
+int re_join(_regex *re, int list, int list2);
+void re_classes(_regex *re);
+void re_literal(_regex *re);
+void init_dfa(_dfa *d, _regex *re, int anchored);
+void reset_dfa(_dfa *d);
+void free_dfa(_dfa *d);
+int cmp_int(const void *a, const void *b);
+int dfa_state(_dfa *d, int *set, int n);
+void re_closure(_dfa *d, int s, int *n, int anchor);
+int dfa_start(_dfa *d);
+int dfa_next(_dfa *d, int s, int sym);
+void init_re_scan(_re_scan *rs, _regex *re);
+void free_re_scan(_re_scan *rs);
+int regex_end(_dfa *d, char *txt, int len, int from);
+int regex_longest(_dfa *d, char *txt, int len, int from);
+int regex_in_line(_re_scan *rs, char *txt, int len, int from, int *end);
+long find_regex(_finder *fd, _line *ln, long from);
+long regex_all(_txt_buf *txt_buf, _regex *re, _re_match *list, long *lines, int *threads);
+void *regex_job(void *job);
 
 void fix_cursor(_cursor_inst *cursor);
-void move_cursor_to_target(char ***txt_buf, _cursor_inst *cursor, int offset, long linenum);
-int move_cursor(char*** txt_buf, _cursor_inst *cursor, int direction);
-int move_cursor_advanced(char*** txt_buf, _cursor_inst *cursor, int key);
+void fix_cursor_gutter(_cursor_inst *cursor);
+void move_cursor_to_target(_cursor_inst *cursor, int offset, long linenum);
+void move_cursor_into_view(_txt_buf *txt_buf, _cursor_inst *cursor, int offset, long linenum);
+int move_cursor(_txt_buf *txt_buf, _cursor_inst *cursor, int direction);
+int move_cursor_advanced(_txt_buf *txt_buf, _cursor_inst *cursor, int key);
 
 int show_bool_query(char *query);
-void format_line_num_out(long n);
-int draw_screen_text(char ***txt_buf, _cursor_inst cursor, int ch, int saved);
+int show_text_query(_cursor_inst *cursor, char *query, char *txt, int size);
+void show_status(_cursor_inst *cursor);
+int find_and_show(_txt_buf *txt_buf, _cursor_inst *cursor, int key);
+int find_and_move(_txt_buf *txt_buf, _cursor_inst *cursor, _finder *fd);
+int regex_and_show(_txt_buf *txt_buf, _cursor_inst *cursor, int key);
+int goto_and_show(_txt_buf *txt_buf, _cursor_inst *cursor);
+int replace_and_show(_txt_buf *txt_buf, _cursor_inst *cursor);
+void format_line_num(char *dst, long n, int width);
+int format_int(char *dst, long n);
+int draw_screen_text(_txt_buf *txt_buf, _cursor_inst cursor, int ch, int saved);
+void size_frame(int rows, int cols);
+void draw_frame_row(int row, char *txt);
+void frame_text(char *row, int col, char *txt);
+void forget_frame_row(int row);
+void dirty_lines(long n, long n2);
 
 
 //*** the platform-specific functions start here...
 
 void* handle_size(int sig);                          //misc. platform-dependent
 int get_input();
+int poll_input();
+int wait_input(int wait);
+void wake_input();
+void init_wake_pipe();
 
 void _display_init();                                //terminal display library frontend
 void _display_cursor_update(_cursor_inst *cursor);
@@ -296,6 +862,12 @@ void _display_clear_eol();
 void _display_string(char* str);
 void _display_exit();
 
+#ifdef _VT_DISPLAY
+int vt_key(int wait);                                //the VT backend
+int vt_byte(int wait);
+void vt_put(char *txt, long len);
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -303,6 +875,57 @@ void _display_exit();
 
 
 int resize_scr = 1;                                     //for the resize display event
+volatile sig_atomic_t bg_event = 0;                     //background work needs attention
+int wake_pipe[2] = {-1, -1};                            //written to wake the input loop for it
+char status_msg[128] = "";                              //message for the bottom line
+
+long blk_gen = 0;                                       //generation given to new blocks of lines
+long snap_gen = -1;                                     //blocks no newer are in a snapshot, -1 if none
+void **retired = NULL;                                  //memory a snapshot needs until it's saved
+long n_retired = 0;
+long max_retired = 0;
+
+int load_threads = 0;                                   //loading threads, 0 for one per core
+long undo_cap = _UNDO_CAP << 20;                        //bytes of undo history kept
+int view_only = FALSE;                                  //viewing the file, no changes
+int map_lines = FALSE;                                  //lines point into the mapped file until edited
+char *scan_kernel = "scalar";                           //loader scanning kernels in use
+int (*scan_newlines)(char *src, int n, int *pos) = find_newlines;
+int (*scan_sanitize)(char *dst, char *src, long n) = copy_sanitized;
+long (*scan_find)(char *src, long n, char *txt, int len) = find_text;
+long (*scan_find_last)(char *src, long n, char *txt, int len) = find_last_text;
+char find_txt[_FIND_LEN] = "";                          //the text last looked for
+int index_trigrams = FALSE;                             //trigrams of blocks of lines are indexed
+char *tri_saved = NULL;                                 //the index saved for the file, mapped...
+long tri_saved_size = 0;
+long tri_saved_count = 0;                               //...and the blocks in it
+int tri_out = -1;                                       //or the new one being written
+long tri_new = 0;
+char *tri_path = NULL;
+char find_re_txt[_FIND_LEN] = "";                       //the regex last looked for...
+_regex *find_re = NULL;                                 //...compiled
+#ifdef _VT_DISPLAY
+char *vt_out = NULL;                                    //what's going out to the terminal
+long vt_len = 0;                                        //next, all written at once
+long vt_size = 0;
+int vt_row = -1;                                        //where its cursor is, -1 if that
+int vt_col = -1;                                        //isn't known
+int vt_cols = 0;
+unsigned char vt_in[64];                                //keys read but not yet decoded
+int vt_in_len = 0;
+int vt_in_at = 0;
+struct termios vt_saved;                                //its settings to go back to
+int vt_on = FALSE;
+#endif
+char *frame = NULL;                                     //what's on the screen, by rows of
+int frame_rows = 0;                                     //cols and a flag for if it's known
+int frame_cols = 0;
+char *frame_row = NULL;                                 //the row being drawn
+int frame_buf_x = -1;                                   //where the text was when drawn
+int frame_buf_y = -1;
+int frame_min_x = -1;
+long dirty_top = 0;                                     //lines changed since, first...
+long dirty_end = LONG_MAX;                              //...and last
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -310,49 +933,108 @@ int resize_scr = 1;                                     //for the resize display
 int main (int argc, char **argv)
 {
    char *open_file = _BUFDUMP;                          //file to open
-   int mode = parse_input(argc, argv);                  //check input, set mode
-   char ***txt_buf = init_txt_buf();                    //the text-buffering mess...
-   _cursor_inst cursor = {0, 0, 0, 0, 0, 0, 0, 0, 4, 
-                          NULL, -1, 0, 0, 0, 0, 0};     //our text cursor
+   int mode = parse_input(argc, argv, &open_file);      //check input, set mode
+   _txt_buf *txt_buf = init_txt_buf();                  //the text buffer
+   _cursor_inst cursor = {0, 0, 0, 0, 0, 0, 0, 0, 4,
+                          {NULL, 0, 0, 0, FALSE, -1}, -1, 0, 0, 0, 0, 0};  //our text cursor
 
    int ch = 0;                                          //input
+   int next = 0;                                        //key typed after it
+   int last_ch = 0;                                     //last key, for display
 
    int update_scr = 1;                                  //draw the screen first time
    int update_sav = 0;                                  //file saved flag
+   int update_due = 0;                                  //keys not yet drawn changed it
+
+   if (mode == _MD_BUF)                                 //if unspecified, use default,
+      mode = (access(open_file, F_OK) == 0) ? _MD_OPEN : _MD_NEW;
 
-   if (mode == _MD_OPEN)                                //if specified change the file
-      open_file = argv[1];                              //to open in buffer
-   else if (mode == _MD_BUF)                            //if unspecified, use default,
-      mode = _MD_OPEN;                                  //so no changes
+   init_scan_kernels();                                 //pick the fastest loader kernels
 
    if (mode == _MD_OPEN)                                //open a file and load it into
       load_file(txt_buf, open_file);                    //buffer
+   else if (mode == _MD_NEW)                            //new file, nothing to load
+      mode = _MD_OPEN;
+
+   if ((mode == _MD_OPEN) && (!view_only))              //note edits, getting back any
+   {                                                    //a crash lost
+      txt_buf->undo = init_undo();
+      open_journal(txt_buf, open_file);
+   }
 
    if (mode != _MD_QUIT)                                //initialize our display
       _display_init();
 
    while(mode != _MD_QUIT)                              //program operation loop
    {
+      last_ch = (ch != _KB_EVENT) ? ch : last_ch;
+
       switch(ch)
       {
+         case _KB_EVENT:           //more of the file finished loading, or saving, or
+         {                         //there are edits to journal
+            update_scr = (attach_loaded_lines(txt_buf) || update_scr);
+
+            if (txt_buf->journal != NULL)
+               flush_journal(txt_buf->journal);
+
+            if (txt_buf->saving != NULL)
+            {
+               update_sav = (finish_save(txt_buf, FALSE) || update_sav);
+               update_scr = 1;
+            }
+
+            ch = last_ch;
+            break;
+         }
+
          case _KB_ESC:             //user wants to exit
          case _KB_CTRL_C:
          case _KB_CTRL_Q:
          {
-            if(save_file(txt_buf, open_file, update_sav, TRUE) == TRUE)
+            if (txt_buf->saving != NULL)                 //let it finish first
+               update_sav = (finish_save(txt_buf, TRUE) || update_sav);
+
+            if((view_only) || (save_file(txt_buf, open_file, update_sav, TRUE) == TRUE))
                mode = _MD_QUIT;
             break;
          }
 
+         case _KB_CTRL_F:          //user wants to find something
+         case _KB_CTRL_G:
+         {
+            update_scr = (find_and_show(txt_buf, &cursor, ch) || update_scr);
+            break;
+         }
+
+         case _KB_CTRL_H:          //user wants to go to a line
+         {
+            update_scr = (goto_and_show(txt_buf, &cursor) || update_scr);
+            break;
+         }
+
+         case _KB_CTRL_E:          //user wants to find a regex, or count it
+         case _KB_CTRL_W:
+         {
+            update_scr = (regex_and_show(txt_buf, &cursor, ch) || update_scr);
+            break;
+         }
+
          case _KB_CTRL_S:          //user wants to save
          {
-            update_sav = save_file(txt_buf, open_file, FALSE, FALSE);
+            if (view_only)
+               strcpy(status_msg, "view only, not saved");
+            else
+               update_sav = save_file(txt_buf, open_file, FALSE, FALSE);
             update_scr = 1;
             break;
          }
 
          default:                  //user input text or moved cursor
          {
+            //the edits this key makes are undone together, typing runs too
+            undo_step(txt_buf, alphanum(ch) || (ch == _KB_TB) || (ch == _KB_BKS));
+
             //check for more complex cursor actions
             update_scr = (move_cursor_advanced(txt_buf, &cursor, ch) || update_scr);
 
@@ -370,6 +1052,22 @@ int main (int argc, char **argv)
       if (resize_scr)
          fix_cursor(&cursor);
 
+      //make room for the line numbers if the buffer outgrew them
+      fix_cursor_gutter(&cursor);
+
+      //keys already typed go in before anything is drawn, the screen then
+      //catches up with all of them at once
+      if ((!resize_scr) && (mode != _MD_QUIT) && ((next = poll_input()) != ERR))
+      {
+         update_due = (update_due || update_scr);
+         update_scr = 0;
+         ch = next;
+         continue;
+      }
+
+      update_scr = (update_scr || update_due);
+      update_due = 0;
+
       //draw our text buffer area if we changed anything
       if ((update_scr) || (resize_scr))
          update_scr = !(draw_screen_text(txt_buf, cursor, ch, update_sav));
@@ -381,10 +1079,14 @@ int main (int argc, char **argv)
       if ((!resize_scr) && (mode != _MD_QUIT))
          ch = get_input();
       else if (resize_scr)
-         resize_scr = 0;           //loop around once to redraw, then we're done
+      {
+         resize_scr = 0;           //loop around once to redraw, then we're done,
+         ch = _KB_EVENT;           //without doing the last key over again
+      }
    } //while
 
    _display_exit();                //clean up
+   close_journal(txt_buf);         //all saved one way or another
 
 
    return (0);
@@ -393,400 +1095,4833 @@ int main (int argc, char **argv)
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
-char *init_new_line()
+_line init_new_line()
 {
-   //initializes new blank single line, returns pointer
+   //returns a new blank line; storage is allocated on the first insert
 
-   char* new_line = (char*) malloc(2 * sizeof(char));
-
-   new_line[0] = _ENDCHAR;
-   new_line[1] = '\0';
+   _line new_line = {NULL, 0, 0, 0, FALSE, -1};
 
    return(new_line);
 }
 
 
-char **init_ptr_buf(int n)
+void free_line(_line *ln)
 {
-   //intializes the array pointer elements to null and
-   //returns the pointer to new array
-
-   //works on the n-line pointer set pointers only
-
-   char **new_buf = (char**) malloc(n * sizeof(char*));
-
-   int i;
-   for (i = 0; i < n; i++)
-      new_buf[i] = NULL;
+   //frees the text of a line, unless it is still in the file; a snapshot
+   //being saved may still need it, so then it's freed after the save
 
-   return(new_buf);
+   if (ln->shared == _SHARE_SAVE)
+      retire(ln->txt);
+   else if (!ln->shared)
+      free(ln->txt);
 }
 
 
-char ***init_txt_buf()
+void own_line(_line *ln)
 {
-   //initializes text buffer, an array of sets of _MAX_LINES strings
-
-   int i;
-   char ***txt_buf = (char***) malloc(_MAX_LINES * sizeof(char**));
+   //readies a line for editing, giving a line still pointing into the file or
+   //a snapshot a copy of its text; only the lines that get edited are ever copied
 
-   for (i = 0; i < _MAX_LINES; i++)                     //initialize this thing to null
-      txt_buf[i] = NULL;
+   char *txt;
+   int size = (ln->len < 8) ? 16 : 2 * ln->len;
 
-   txt_buf[0] = init_ptr_buf(_MAX_LINES);               //init. the first 1000 lines
-   txt_buf[0][0] = init_new_line();                     //create blank new text buffer
+   ln->orig = -1;                                       //it's about to be changed
 
-   return(txt_buf);
-}
+   if (!ln->shared)
+      return;
 
+   if (ln->shared == _SHARE_SAVE)                       //a copy as it is, gap and all
+   {
+      size = ln->len + ln->gap_len;
+      txt = (size > 0) ? malloc(size * sizeof(char)) : NULL;
+      memcpy(txt, ln->txt, size);
+      retire(ln->txt);
+      ln->txt = txt;
+      ln->shared = FALSE;
+      return;
+   }
 
-void init_blank_lines(char ***txt_buf, int k, int j)
-{
-   //intializes the blank lines up to the
-   //specified point
+   txt = malloc(size * sizeof(char));
+   scan_sanitize(txt, ln->txt, ln->len);
 
-   while (txt_buf[k][j] == NULL)                        //loop through the lines
-   {
-      txt_buf[k][j] = init_new_line();                  //init. any blank ones
-      j--;
-      if (j < 0)
-      {
-         j = _MAX_LINES - 1;
-         k--;
-      }
-   } //while
+   ln->txt = txt;
+   ln->gap = ln->len;
+   ln->gap_len = size - ln->len;
+   ln->shared = FALSE;
 }
 
 
-void init_null_sections(char ***txt_buf, int k, int j)
+void retire(void *mem)
 {
-   //initializes all the sections and lines that are still null
-   //up to the specified location
+   //holds on to memory a snapshot being saved still uses, until it's done
 
-   int q = k;                                           //counter
+   if (mem == NULL)
+      return;
 
-   while (txt_buf[q] == NULL)                           //loop through the null sets
-   {                                                    //and init. them
-      txt_buf[q] = init_ptr_buf(_MAX_LINES);
-      q--;
+   if (n_retired == max_retired)
+   {
+      max_retired = (max_retired == 0) ? 1024 : 2 * max_retired;
+      retired = realloc(retired, max_retired * sizeof(void*));
    }
 
-   if (txt_buf[k][j] == NULL)                           //init. current set
-      init_blank_lines(txt_buf, k, j);
+   retired[n_retired++] = mem;
 }
 
 
-char *del_char_from_line(char *old, int offset, int curlen)
+_line_blk *init_line_blk()
 {
-   //deletes a character from the string
-
-   char *str = malloc((curlen) * sizeof(char));
+   //initializes a new empty block of lines for the line tree
+
+   _line_blk *blk = (_line_blk*) malloc(sizeof(_line_blk));
+
+   blk->lf = NULL;
+   blk->rt = NULL;
+   blk->pri = rand();
+   blk->n_lines = 0;
+   blk->n_bytes = 0;
+   blk->bytes = 0;
+   blk->count = 0;
+   blk->gen = blk_gen;
+   blk->orig = -1;
+   blk->tri = NULL;
+   blk->tri_dirty = 0;
+
+   return(blk);
+}
 
-   strncpy(str, old, offset);
-   strncpy(&str[offset - 1], &old[offset], curlen - offset);
-   str[curlen - 1] = '\0';
 
-   free(old);
+_txt_buf *init_txt_buf()
+{
+   //initializes text buffer, a tree of blocks of lines holding one blank line
+
+   _txt_buf *txt_buf = (_txt_buf*) malloc(sizeof(_txt_buf));
+
+   txt_buf->root = NULL;
+   txt_buf->loading = NULL;
+   txt_buf->saving = NULL;
+   txt_buf->changes = 0;
+   txt_buf->hint = NULL;
+   txt_buf->file = NULL;
+   txt_buf->file_size = 0;
+   txt_buf->file_mapped = FALSE;
+   txt_buf->base = -1;
+   txt_buf->base_size = 0;
+   txt_buf->base_time.tv_sec = 0;
+   txt_buf->base_time.tv_nsec = 0;
+   txt_buf->journal = NULL;
+   txt_buf->undo = NULL;
+   insert_line(txt_buf, 0, init_new_line());            //create blank new text buffer
 
-   return(str);
+   return(txt_buf);
 }
 
 
-char *add_char_to_line(char *old, char add, int offset, int curlen)
+void init_blank_lines(_txt_buf *txt_buf, long n)
 {
-   //inserts a character into the string
+   //initializes blank lines at the end of the buffer
+   //until line n exists
 
-   char *str = malloc((curlen + 2) * sizeof(char));
+   wait_for_lines(txt_buf, n);
 
-   strncpy(str, old, offset);
-   strncpy(&str[offset + 1], &old[offset], curlen - offset);
-   str[offset] = add;
-   str[curlen + 1] = '\0';
+   if (num_lines(txt_buf) <= n)
+   {
+      long last = num_lines(txt_buf) - 1, k = n - last;
+      char *nl = malloc(k);
 
-   free(old);
+      journal_edit(txt_buf, _JN_BLANK, n, 0, 0);
+      memset(nl, '\n', k);
+      note_undo(txt_buf, _UN_INS, last, get_line(txt_buf, last)->len, nl, k);
+      free(nl);
+   }
 
-   return(str);
+   while (num_lines(txt_buf) <= n)
+      insert_line(txt_buf, num_lines(txt_buf), init_new_line());
 }
 
 
-char *add_char_to_line_end(char *old, char add, int offset, int curlen)
+void free_line_blks(_line_blk *blk)
 {
-   //inserts character beyond the end of line
+   //frees a line tree and all the lines in it
 
-   char *str = malloc((offset + 3) * sizeof(char));
+   int i;
 
-   memset(&str[curlen - 1], 32, ((offset + 1) - curlen));
-   strncpy(str, old, curlen - 1);
-   str[offset] = add;
-   str[offset + 1] = _ENDCHAR;
-   str[offset + 2] = '\0';
+   if (blk == NULL)
+      return;
 
-   free(old);
+   free_line_blks(blk->lf);
+   free_line_blks(blk->rt);
 
-   return(str);
+   for (i = 0; i < blk->count; i++)
+      free_line(&blk->line[i]);
+   free(blk->tri);
+   free(blk);
 }
 
 
-long num_lines(char ***txt_buf)
+void drop_line_blks(_line_blk *blk)
 {
-   //returns number of lines until NULL
+   //frees a tree of lines taken out of the buffer; what a snapshot being
+   //saved still uses is only freed once it's saved
 
-   long l = 0, s = 0;
+   int frozen, i;
 
-   while(txt_buf[s + 1] != NULL)
-      s++;
+   if (blk == NULL)
+      return;
 
-   while(txt_buf[s][l] != NULL)
-      l++;
+   drop_line_blks(blk->lf);
+   drop_line_blks(blk->rt);
 
-   return((_MAX_LINES * s) + l);
+   frozen = (blk->gen <= snap_gen);
+   free(blk->tri);                                      //a snapshot has no use for it
+
+   for (i = 0; i < blk->count; i++)
+   {
+      if ((frozen) && (!blk->line[i].shared))
+         retire(blk->line[i].txt);
+      else
+         free_line(&blk->line[i]);
+   }
+
+   if (frozen)
+      retire(blk);
+   else
+      free(blk);
 }
 
 
-int alphanum(int ch)
+void append_line_blk(_txt_buf *txt_buf, _line_blk *blk)
 {
-   //returns TRUE if ch represents alphanumerical ASCII value
+   //attaches a filled block of lines to the end of the buffer, indexing
+   //its trigrams first if they're indexed
 
-   return((ch >= 32) && (ch <= 126));
+   if (index_trigrams)
+      index_line_blk(blk);
+
+   update_line_blk(blk);
+   txt_buf->root = merge_line_blks(txt_buf->root, blk);
 }
 
 
-int parse_input(int c, char **v)
+void update_line_blk(_line_blk *blk)
 {
-   //parses input arguments, returns appropriate mode
+   //recomputes the subtree totals of a block from its children
 
-   int mode = 0;
+   blk->n_lines = blk->count;
+   blk->n_bytes = blk->bytes;
 
-   if (c == 1)                                //if no command line arguments,
-   {                                          //set default _bufdump mode
-      mode = _MD_BUF;
+   if (blk->lf != NULL)
+   {
+      blk->n_lines += blk->lf->n_lines;
+      blk->n_bytes += blk->lf->n_bytes;
    }
-   else if (c == 2)                           //file specified
+   if (blk->rt != NULL)
    {
-      FILE *fp;
-      char ch[_MAX_LINES];
+      blk->n_lines += blk->rt->n_lines;
+      blk->n_bytes += blk->rt->n_bytes;
+   }
+}
 
-      if ((fp = fopen(v[1], "r")) == NULL)    //check if file specified exists
-      {
-         //confirm we want to create the new file
-         printf("\nfile does not exist; create");
-         while ((ch[0] != 'y') && (ch[0] != 'n') && (ch[0] != 'Y') && (ch[0] != 'N'))
-         {
-            printf(" (y/n)? ");
-            scanf("%s", ch);
-         }
 
-         if ((ch[0] == 'y') || (ch[0] == 'Y'))
-            mode = _MD_OPEN;
-         else
-            mode = _MD_QUIT;
-      }
-      else
-      {
-         fclose(fp);                          //everything worked fine, file exists
-         mode = _MD_OPEN;
-      }
-   }
-   else
+_line_blk *merge_line_blks(_line_blk *a, _line_blk *b)
+{
+   //joins two line trees, all lines of a going before all lines of b
+
+   if (a == NULL)
+      return(b);
+   if (b == NULL)
+      return(a);
+
+   if (a->pri > b->pri)
    {
-      printf("\ncommand line format: noir filepath\n");
-      mode = _MD_QUIT;
+      a = thaw_line_blk(a);
+      a->rt = merge_line_blks(a->rt, b);
+      update_line_blk(a);
+      return(a);
    }
 
-   return(mode);
+   b = thaw_line_blk(b);
+   b->lf = merge_line_blks(a, b->lf);
+   update_line_blk(b);
+   return(b);
 }
 
 
-void load_file(char ***txt_buf, char *filename)
+void split_line_blks(_line_blk *blk, long n, _line_blk **a, _line_blk **b)
 {
-   //loads an ascii text file into the buffer
+   //splits a line tree in two, the first n lines going to a and the rest to b;
+   //a block straddling the split point is cut in two
 
-   FILE *fp;
-   
-   if ((fp = fopen(filename, "r")) == NULL)
+   long lf_lines;
+
+   if (blk == NULL)
    {
-      printf("\nerror opening file.\n");
-      exit(0);
+      *a = NULL;
+      *b = NULL;
+      return;
    }
-   else
-   {
-      int cur = getc(fp);
-      int counter = 0;
-      long line_count = 0;
 
-      while (cur != EOF)
-      {
-         int curlen = strlen(txt_buf[line_count / _MAX_LINES][line_count % _MAX_LINES]);
-         if (cur != '\n')
-         {
-            if (!(alphanum(cur)))    //if we encounter non-displayable characters...
-               cur = 'X';
-            txt_buf[line_count / _MAX_LINES][line_count % _MAX_LINES] =
-               add_char_to_line(txt_buf[line_count / _MAX_LINES][line_count % _MAX_LINES],
-                                cur, counter, curlen);
-            counter++;
-         }
-         else                        //encountered a newline
-         {
-            line_count++;
-            counter = 0;
+   blk = thaw_line_blk(blk);
+   lf_lines = (blk->lf != NULL) ? blk->lf->n_lines : 0;
 
-            if (txt_buf[line_count / _MAX_LINES] == NULL)
-               txt_buf[line_count / _MAX_LINES] = init_ptr_buf(_MAX_LINES);
+   if (n <= lf_lines)                                   //split point on the left
+   {
+      split_line_blks(blk->lf, n, a, &blk->lf);
+      update_line_blk(blk);
+      *b = blk;
+   }
+   else if (n >= lf_lines + blk->count)                 //split point on the right
+   {
+      split_line_blks(blk->rt, n - lf_lines - blk->count, &blk->rt, b);
+      update_line_blk(blk);
+      *a = blk;
+   }
+   else                                                 //split point inside this block
+   {
+      _line_blk *cut = init_line_blk();
+      int keep = n - lf_lines;
+      int i;
 
-            txt_buf[line_count / _MAX_LINES][line_count % _MAX_LINES] = init_new_line();
-         }
+      cut->count = blk->count - keep;
+      memcpy(cut->line, &blk->line[keep], cut->count * sizeof(_line));
+      for (i = 0; i < cut->count; i++)
+         cut->bytes += cut->line[i].len + 1;
+      update_line_blk(cut);
 
-         cur = getc(fp);
-      } //while
+      if (blk->tri != NULL)                             //both halves hold no more
+      {
+         cut->tri = malloc(_TRI_SIZE);
+         memcpy(cut->tri, blk->tri, _TRI_SIZE);
+         cut->tri_dirty = blk->tri_dirty >> keep;
+         blk->tri_dirty &= (1ULL << keep) - 1;
+      }
 
-      fclose(fp);
+      blk->count = keep;
+      blk->bytes -= cut->bytes;
+      blk->orig = line_blk_orig(blk);
+      cut->orig = line_blk_orig(cut);
+      *b = merge_line_blks(cut, blk->rt);
+      blk->rt = NULL;
+      update_line_blk(blk);
+      *a = blk;
    }
 }
 
-int save_file(char ***txt_buf, char *filename, int saved, int exiting)
+
+long line_blk_orig(_line_blk *blk)
 {
-   //saves the buffer to an ascii text file
+   //returns where the lines of the block are in the file as loaded, if
+   //they are all unedited and still in order there, else -1
 
-   int success = saved;
-   int save = !exiting;
+   long next = blk->line[0].orig;
+   int i;
 
-   if ((exiting) && (!success))          //if we're exiting and buffer is unsaved
-   {
-      if (strcmp(filename, _BUFDUMP))
-         save = show_bool_query("save (y/n)? ");
-      else                               //if we're editing _BUFDUMP, no choice
-         save = TRUE;                    //since both choices save to _bufdump
+   for (i = 0; (i < blk->count) && (next >= 0); i++)
+      next = (blk->line[i].orig == next) ? next + blk->line[i].len + 1 : -1;
 
-      if (!save)                         //if we're not saving...
-      {
-         success = TRUE;                 //save anyway to _BUFDUMP
+   return((next >= 0) ? blk->line[0].orig : -1);
+}
 
-         filename = realloc(filename, 60 * sizeof(char));
-         filename = _BUFDUMP;
-      }
-   } //if
 
-   if (TRUE)                             //*** DEBUG/MOD: for later modification
+_line_blk *find_line_blk(_line_blk *blk, long n, int *i)
+{
+   //finds the block holding line n, and the position i of the line inside it
+
+   while (blk != NULL)
    {
-      FILE *fp;
+      long lf_lines = (blk->lf != NULL) ? blk->lf->n_lines : 0;
 
-      if ((fp = fopen(filename, "w")) == NULL)
-         printf("\nerror opening file.\n");
+      if (n < lf_lines)
+         blk = blk->lf;
+      else if (n < lf_lines + blk->count)
+      {
+         *i = n - lf_lines;
+         return(blk);
+      }
       else
       {
-         int char_count = 0;
-         long line_count = 0;
-         long buf_end = num_lines(txt_buf);
+         n -= lf_lines + blk->count;
+         blk = blk->rt;
+      }
+   } //while
 
-         for (line_count = 0; line_count < buf_end; line_count++)
-         {
-            int line_len = strlen(txt_buf[line_count / _MAX_LINES][line_count % _MAX_LINES]) - 1;
+   return(NULL);
+}
 
-            //put the line into the file
-            for (char_count = 0; char_count < line_len; char_count++)
-               putc(txt_buf[line_count / _MAX_LINES][line_count % _MAX_LINES][char_count], fp);
 
-            //end the line
-            if (line_count < (buf_end - 1))
-               putc('\n', fp);
-         } //for
+void count_line_blks(_line_blk **link, long n, int d_lines, long d_bytes)
+{
+   //adjusts the line and byte totals on the path down from *link to the
+   //block holding line n, and the byte count of that block
 
-         fclose(fp);
-         success = TRUE;
-      }
-   } //if
+   while (*link != NULL)
+   {
+      _line_blk *blk = *link = thaw_line_blk(*link);
+      long lf_lines = (blk->lf != NULL) ? blk->lf->n_lines : 0;
 
-   return(success);
+      blk->n_lines += d_lines;
+      blk->n_bytes += d_bytes;
+
+      if (n < lf_lines)
+         link = &blk->lf;
+      else if (n < lf_lines + blk->count)
+      {
+         blk->bytes += d_bytes;
+         return;
+      }
+      else
+      {
+         n -= lf_lines + blk->count;
+         link = &blk->rt;
+      }
+   } //while
 }
 
 
-void fix_cursor(_cursor_inst *cursor)
+_line_blk *thaw_line_blk(_line_blk *blk)
 {
-   //fixes the cursor if the screen was initialized or resized
+   //returns a block that can be changed: the block itself, or a copy of it
+   //when it's frozen in a snapshot being saved. the lines of the copy share
+   //their text with the snapshot until they get edited
 
-   _display_cursor_update(cursor);   //adjusts the screen dimensions
+   _line_blk *copy;
+   int i;
 
-   cursor->max_y -= 3;               //adjust for scrollbars/last scroll-line
-   cursor->max_x -= 2;
-   cursor->min_y = 1;                //adjust for title
-   cursor->min_x = 8;                //adjust for line numbers
+   if ((blk == NULL) || (blk->gen > snap_gen))
+      return(blk);
 
-   cursor->x = cursor->min_x;        //move the cursor to the top left
-   cursor->y = cursor->min_y;        //corner
+   copy = (_line_blk*) malloc(sizeof(_line_blk));
+   memcpy(copy, blk, sizeof(_line_blk));
+   copy->gen = blk_gen;
+
+   for (i = 0; i < copy->count; i++)
+      if (!copy->line[i].shared)
+         copy->line[i].shared = _SHARE_SAVE;
+
+   retire(blk);
+
+   return(copy);
 }
 
 
-void move_cursor_to_target(char ***txt_buf, _cursor_inst *cursor, int offset, long linenum)
+void thaw_lines(_line_blk *blk)
 {
-   //moves cursor, taking into account scrolling etc. to the specified
-   //location in the active text currently in the buffer
+   //once a snapshot is saved, hands the text it shared back to the lines;
+   //only blocks changed since have lines sharing it, and their parents
+   //are always changed too
+
+   int i;
 
-   while ((cursor->x - cursor->min_x + cursor->buf_x) < offset)
-      move_cursor(txt_buf, cursor, _KB_RT);
-   while ((cursor->x - cursor->min_x + cursor->buf_x) > offset)
-      move_cursor(txt_buf, cursor, _KB_LF);
-   while ((cursor->buf_y + (cursor->y - cursor->min_y)) < linenum)
-      move_cursor(txt_buf, cursor, _KB_DN);
-   while ((cursor->buf_y + (cursor->y - cursor->min_y)) > linenum)
-      move_cursor(txt_buf, cursor, _KB_UP);
+   if ((blk == NULL) || (blk->gen <= snap_gen))
+      return;
+
+   for (i = 0; i < blk->count; i++)
+      if (blk->line[i].shared == _SHARE_SAVE)
+         blk->line[i].shared = FALSE;
+
+   thaw_lines(blk->lf);
+   thaw_lines(blk->rt);
 }
 
 
-int move_cursor(char ***txt_buf, _cursor_inst *cursor, int direction)
+_line_blk *find_buf_line(_txt_buf *txt_buf, long n, int *i)
 {
-   //moves the cursor in the specified direction, making sure to
-   //take the display, buffer offset, and cushion into account
+   //finds the block holding line n of the buffer, going straight to the
+   //block of the last lookup when the line is in it
 
-   int update = TRUE;  //assume something will happen, if not later set to FALSE
+   _line_blk *blk;
 
-   switch(direction)
+   if ((txt_buf->hint != NULL) && (n >= txt_buf->hint_start) &&
+       (n < txt_buf->hint_start + txt_buf->hint->count))
    {
-      case _KB_UP:
-      {
-         if (cursor->y > cursor->min_y)                         //move cursor up
-            cursor->y--;
-         else if (cursor->buf_y > 0)                            //scroll up
-            cursor->buf_y--;
-         else 
-            update = FALSE;
+      *i = n - txt_buf->hint_start;
+      return(txt_buf->hint);
+   }
 
-         break;
-      }
+   if ((n < 0) || ((blk = find_line_blk(txt_buf->root, n, i)) == NULL))
+      return(NULL);
 
-      case _KB_DN:
-      {
-         if (cursor->y <= cursor->max_y)                        //move cursor down
-            cursor->y++;
-         else                                                   //scroll down
-            cursor->buf_y++;
+   txt_buf->hint = blk;
+   txt_buf->hint_start = n - *i;
 
-         break;
-      }
+   return(blk);
+}
 
-      case _KB_LF:
-      {
-         if (cursor->x > (cursor->min_x + cursor->cushion))     //move cursor left
-            cursor->x--;
-         else if (cursor->buf_x > 0)                            //scroll left
-            cursor->buf_x--;
-         else if (cursor->x > cursor->min_x)                    //no more scroll, only move
-            cursor->x--;
-         else if (cursor->x == cursor->min_x)                   //beginnig of line, move to
-         {                                                      //end of previous line
-            if (move_cursor(txt_buf, cursor, _KB_UP))
-               move_cursor(txt_buf, cursor, _KB_ED);
-         }
 
-         break;
-      }
+_line *get_line(_txt_buf *txt_buf, long n)
+{
+   //returns line n, or NULL if there is no such line
 
-      case _KB_RT:
-      {
-         if (cursor->x <= (cursor->max_x - cursor->cushion))    //move cursor right
-            cursor->x++;
-         else                                                   //scroll right
-            cursor->buf_x++;
+   _line_blk *blk;
+   int i;
+
+   if ((n >= num_lines(txt_buf)) && (txt_buf->loading != NULL))
+      wait_for_lines(txt_buf, n);           //it may just not be loaded yet
+
+   if ((blk = find_buf_line(txt_buf, n, &i)) == NULL)
+      return(NULL);
+
+   return(&blk->line[i]);
+}
+
+
+_line_blk *edit_buf_line(_txt_buf *txt_buf, long n, int *i)
+{
+   //finds the block holding line n of the buffer for changing it; every
+   //edit looks its line up through here. while a snapshot is being saved
+   //the blocks on the way down are copied rather than changed
+
+   _line_blk *blk;
+
+   txt_buf->changes++;
+   dirty_lines(n, n);
+
+   if (snap_gen >= 0)
+   {
+      count_line_blks(&txt_buf->root, n, 0, 0);
+      txt_buf->hint = NULL;
+   }
+
+   if ((blk = find_buf_line(txt_buf, n, i)) != NULL)
+   {
+      blk->orig = -1;                                   //no longer as loaded
+      blk->tri_dirty |= 1ULL << *i;
+   }
+
+   return(blk);
+}
+
+
+_line *edit_line(_txt_buf *txt_buf, long n)
+{
+   //returns line n for changing it, or NULL if there is no such line
+
+   _line_blk *blk;
+   int i;
+
+   if ((blk = edit_buf_line(txt_buf, n, &i)) == NULL)
+      return(NULL);
+
+   return(&blk->line[i]);
+}
+
+
+void insert_line(_txt_buf *txt_buf, long n, _line ln)
+{
+   //inserts ln into the buffer so that it becomes line n
+
+   _line_blk *blk, *a, *b;
+   long total = num_lines(txt_buf);
+   int i = 0, j;
+
+   dirty_lines(n, LONG_MAX);                            //the lines below move down
+
+   if (total == 0)                                      //nothing to attach to
+   {
+      txt_buf->root = init_line_blk();
+      txt_buf->root->line[0] = ln;
+      txt_buf->root->count = 1;
+      txt_buf->root->bytes = ln.len + 1;
+      update_line_blk(txt_buf->root);
+      return;
+   }
+
+   //appending goes into the block holding the last line
+   blk = edit_buf_line(txt_buf, (n < total) ? n : total - 1, &i);
+   i += (n >= total);
+   txt_buf->hint = NULL;                                //line numbers are shifting
+
+   if (blk->count == _BLK_LINES)                        //full, split it in half first
+   {
+      long start = n - i;
+
+      split_line_blks(txt_buf->root, start + (_BLK_LINES / 2), &a, &b);
+      txt_buf->root = merge_line_blks(a, b);
+
+      if (i > (_BLK_LINES / 2))                         //goes into the second half
+      {
+         blk = find_line_blk(txt_buf->root, start + (_BLK_LINES / 2), &j);
+         i -= (_BLK_LINES / 2);
+      }
+   }
+
+   count_line_blks(&txt_buf->root, n - i, 1, ln.len + 1);
+
+   blk->orig = -1;
+   blk->tri_dirty |= ~0ULL << i;                        //the lines from here on move
+   memmove(&blk->line[i + 1], &blk->line[i], (blk->count - i) * sizeof(_line));
+   blk->line[i] = ln;
+   blk->count++;
+}
+
+
+void remove_line(_txt_buf *txt_buf, long n)
+{
+   //takes line n out of the buffer and frees it
+
+   _line_blk *blk, *a, *b, *c;
+   int i;
+
+   dirty_lines(n, LONG_MAX);                            //the lines below move up
+
+   if ((blk = edit_buf_line(txt_buf, n, &i)) == NULL)
+      return;
+
+   free_line(&blk->line[i]);
+   txt_buf->hint = NULL;                                //line numbers are shifting
+
+   if (blk->count > 1)                                  //close the gap in the block
+   {
+      count_line_blks(&txt_buf->root, n, -1, -(blk->line[i].len + 1));
+      blk->tri_dirty |= ~0ULL << i;
+      blk->count--;
+      memmove(&blk->line[i], &blk->line[i + 1], (blk->count - i) * sizeof(_line));
+   }
+   else                                                 //last line, drop the block
+   {
+      split_line_blks(txt_buf->root, n, &a, &b);
+      split_line_blks(b, 1, &c, &b);
+      txt_buf->root = merge_line_blks(a, b);
+      free(c->tri);
+      free(c);
+   }
+}
+
+
+long line_offset(_txt_buf *txt_buf, long n)
+{
+   //returns the byte offset in the saved file at which line n starts
+
+   _line_blk *blk = txt_buf->root;
+   long offset = 0;
+
+   while (blk != NULL)
+   {
+      long lf_lines = (blk->lf != NULL) ? blk->lf->n_lines : 0;
+      long lf_bytes = (blk->lf != NULL) ? blk->lf->n_bytes : 0;
+
+      if (n < lf_lines)
+         blk = blk->lf;
+      else if (n < lf_lines + blk->count)
+      {
+         int i;
+
+         offset += lf_bytes;
+         for (i = 0; i < n - lf_lines; i++)
+            offset += blk->line[i].len + 1;
+
+         return(offset);
+      }
+      else
+      {
+         offset += lf_bytes + blk->bytes;
+         n -= lf_lines + blk->count;
+         blk = blk->rt;
+      }
+   } //while
+
+   return(offset);
+}
+
+
+long offset_line(_txt_buf *txt_buf, long offset)
+{
+   //returns the line holding the specified byte offset of the saved file,
+   //the newline ending a line counting as part of it
+
+   _line_blk *blk = txt_buf->root;
+   long n = 0;
+
+   while (blk != NULL)
+   {
+      long lf_lines = (blk->lf != NULL) ? blk->lf->n_lines : 0;
+      long lf_bytes = (blk->lf != NULL) ? blk->lf->n_bytes : 0;
+
+      if (offset < lf_bytes)
+         blk = blk->lf;
+      else if (offset < lf_bytes + blk->bytes)
+      {
+         int i;
+
+         offset -= lf_bytes;
+         for (i = 0; offset >= blk->line[i].len + 1; i++)
+            offset -= blk->line[i].len + 1;
+
+         return(n + lf_lines + i);
+      }
+      else
+      {
+         offset -= lf_bytes + blk->bytes;
+         n += lf_lines + blk->count;
+         blk = blk->rt;
+      }
+   } //while
+
+   return(num_lines(txt_buf) - 1);                      //past the end, last line
+}
+
+
+void buf_add_char(_txt_buf *txt_buf, long n, int offset, char add)
+{
+   //inserts a character into line n of the buffer, past the end of line
+   //the line gets padded with spaces
+
+   _line *ln = edit_line(txt_buf, n);
+   int old_len = ln->len;
+
+   journal_edit(txt_buf, _JN_ADD, n, offset, add);
+   note_undo(txt_buf, _UN_INS, n, offset, &add, 1);
+
+   if (offset <= ln->len)
+      add_char_to_line(ln, add, offset);
+   else
+      add_char_to_line_end(ln, add, offset);
+
+   count_line_blks(&txt_buf->root, n, 0, ln->len - old_len);
+}
+
+
+void buf_del_char(_txt_buf *txt_buf, long n, int offset)
+{
+   //deletes the character before offset from line n of the buffer
+
+   _line *ln = edit_line(txt_buf, n);
+   char gone;
+
+   journal_edit(txt_buf, _JN_DEL, n, offset, 0);
+   if (txt_buf->undo != NULL)
+   {
+      copy_line_text(ln, offset - 1, 1, &gone);
+      note_undo(txt_buf, _UN_BKS, n, offset - 1, &gone, 1);
+   }
+
+   del_char_from_line(ln, offset);
+   count_line_blks(&txt_buf->root, n, 0, -1);
+}
+
+
+void buf_split_line(_txt_buf *txt_buf, long n, int offset)
+{
+   //breaks line n of the buffer at offset, the rest of it becoming line n + 1
+
+   _line *ln = edit_line(txt_buf, n);
+   _line new_line = init_new_line();
+
+   journal_edit(txt_buf, _JN_SPLIT, n, offset, 0);
+   note_undo(txt_buf, _UN_INS, n, (offset < ln->len) ? offset : ln->len, "\n", 1);
+
+   if (offset < ln->len)                                //stuff to move
+   {
+      new_line = split_line(ln, offset);
+      count_line_blks(&txt_buf->root, n, 0, -new_line.len);
+   }
+
+   insert_line(txt_buf, n + 1, new_line);
+}
+
+
+void buf_join_lines(_txt_buf *txt_buf, long n)
+{
+   //fuses line n + 1 of the buffer onto the end of line n
+
+   _line *ln = edit_line(txt_buf, n);
+   _line *next = get_line(txt_buf, n + 1);
+
+   journal_edit(txt_buf, _JN_JOIN, n, 0, 0);
+   note_undo(txt_buf, _UN_BKS, n, ln->len, "\n", 1);
+   join_lines(ln, next);
+   count_line_blks(&txt_buf->root, n, 0, next->len);
+
+   remove_line(txt_buf, n + 1);
+}
+
+
+void buf_insert_text(_txt_buf *txt_buf, long n, int offset, char *txt, long len)
+{
+   //inserts text running over any number of lines into line n at offset,
+   //past the end of line the line gets padded with spaces; the whole lines
+   //it makes are built into blocks of their own and go in all at once
+
+   _txt_buf batch = {NULL, NULL, NULL, 0, NULL, 0, NULL, 0, FALSE, -1, 0, {0, 0}, NULL, NULL};
+   _line_blk *blk, *a, *b;
+   _line *ln = edit_line(txt_buf, n);
+   _line last, rest = init_new_line();
+   char *nl = memchr(txt, '\n', len), *end = &txt[len];
+   int old_len = ln->len;
+
+   journal_text(txt_buf, n, offset, txt, len);
+   note_undo(txt_buf, _UN_INS, n, offset, txt, len);
+
+   if (offset > ln->len)
+      add_text_to_line(ln, NULL, offset - ln->len, ln->len);
+
+   if (nl == NULL)                                      //all on the one line
+   {
+      add_text_to_line(ln, txt, len, offset);
+      count_line_blks(&txt_buf->root, n, 0, ln->len - old_len);
+      return;
+   }
+
+   if (offset < ln->len)                                //what follows goes last
+      rest = split_line(ln, offset);
+   add_text_to_line(ln, txt, nl - txt, offset);
+   count_line_blks(&txt_buf->root, n, 0, ln->len - old_len);
+
+   blk = init_line_blk();
+   for (txt = nl + 1; (nl = memchr(txt, '\n', end - txt)) != NULL; txt = nl + 1)
+      blk = append_line(&batch, blk, init_text_line(txt, nl - txt));
+
+   last = init_text_line(txt, end - txt);
+   join_lines(&last, &rest);
+   free_line(&rest);
+   blk = append_line(&batch, blk, last);
+
+   if (blk->count > 0)
+      append_line_blk(&batch, blk);
+   else
+      free(blk);
+
+   split_line_blks(txt_buf->root, n + 1, &a, &b);
+   txt_buf->root = merge_line_blks(merge_line_blks(a, batch.root), b);
+   txt_buf->hint = NULL;
+   dirty_lines(n, LONG_MAX);
+}
+
+
+void buf_delete_range(_txt_buf *txt_buf, long n, int offset, long n2, int offset2)
+{
+   //deletes the text from offset in line n up to offset2 in line n2; the
+   //whole lines in between come out of the tree all at once. offsets past
+   //the end of line are taken as the end of line
+
+   _line *ln, *last;
+   _line_blk *a, *b, *c;
+   int old_len, k;
+
+   if (offset > get_line(txt_buf, n)->len)
+      offset = get_line(txt_buf, n)->len;
+   if (offset2 > get_line(txt_buf, n2)->len)
+      offset2 = get_line(txt_buf, n2)->len;
+   if ((n == n2) && (offset2 <= offset))
+      return;
+
+   journal_range(txt_buf, n, offset, n2, offset2);
+   note_undo_range(txt_buf, n, offset, n2, offset2);
+
+   ln = edit_line(txt_buf, n);
+   old_len = ln->len;
+   move_line_gap(ln, offset);
+
+   if (n == n2)
+   {
+      ln->gap_len += offset2 - offset;
+      ln->len -= offset2 - offset;
+      count_line_blks(&txt_buf->root, n, 0, ln->len - old_len);
+      return;
+   }
+
+   last = get_line(txt_buf, n2);                        //its end comes up onto line n
+   k = last->len - offset2;
+   ln->gap_len += ln->len - offset;
+   ln->len = offset;
+   grow_line(ln, k);
+   copy_line_text(last, offset2, k, &ln->txt[ln->gap]);
+   ln->gap += k;
+   ln->gap_len -= k;
+   ln->len += k;
+   count_line_blks(&txt_buf->root, n, 0, ln->len - old_len);
+
+   split_line_blks(txt_buf->root, n + 1, &a, &b);
+   split_line_blks(b, n2 - n, &b, &c);
+   txt_buf->root = merge_line_blks(a, c);
+   txt_buf->hint = NULL;
+   drop_line_blks(b);
+   dirty_lines(n, LONG_MAX);
+}
+
+
+_line buf_extract_range(_txt_buf *txt_buf, long n, int offset, long n2, int offset2)
+{
+   //takes the text from offset in line n up to offset2 in line n2 out of the
+   //buffer and hands it back as a line of its own, '\n' between the lines;
+   //copied out in one pass and then spliced out with a single delete
+
+   _line out = init_new_line();
+   long len;
+
+   if (offset > get_line(txt_buf, n)->len)
+      offset = get_line(txt_buf, n)->len;
+   if (offset2 > get_line(txt_buf, n2)->len)
+      offset2 = get_line(txt_buf, n2)->len;
+   if ((n == n2) && (offset2 <= offset))
+      return(out);
+
+   len = (n == n2) ? offset2 - offset
+                   : line_offset(txt_buf, n2) + offset2 - line_offset(txt_buf, n) - offset;
+
+   grow_line(&out, len);
+   out.len = copy_range_text(txt_buf, n, offset, n2, offset2, out.txt);
+   out.gap = out.len;
+   out.gap_len -= out.len;
+
+   buf_delete_range(txt_buf, n, offset, n2, offset2);
+
+   return(out);
+}
+
+
+long copy_range_text(_txt_buf *txt_buf, long n, int offset, long n2, int offset2, char *dst)
+{
+   //copies the text from offset in line n up to offset2 in line n2 into dst,
+   //'\n' between the lines, returning how much went in
+
+   char *p = dst;
+   long i;
+
+   for (i = n; i <= n2; i++)
+   {
+      _line *ln = get_line(txt_buf, i);
+      int from = (i == n) ? offset : 0;
+
+      p += copy_line_text(ln, from, ((i == n2) ? offset2 : ln->len) - from, p);
+      if (i < n2)
+         *p++ = '\n';
+   }
+
+   return(p - dst);
+}
+
+
+void buf_replace_line(_txt_buf *txt_buf, long n, char *txt, int len)
+{
+   //replaces the text of line n with txt, which the line takes over as it
+   //is; noted as the old text taken out and the new put in
+
+   _line *ln = get_line(txt_buf, n);
+   int old_len = ln->len;
+
+   journal_range(txt_buf, n, 0, n, old_len);
+   journal_text(txt_buf, n, 0, txt, len);
+   note_undo_range(txt_buf, n, 0, n, old_len);
+   note_undo(txt_buf, _UN_INS, n, 0, txt, len);
+
+   ln = edit_line(txt_buf, n);
+   free_line(ln);
+
+   ln->txt = txt;
+   ln->len = len;
+   ln->gap = len;
+   ln->gap_len = 0;
+   ln->shared = FALSE;
+   ln->orig = -1;
+
+   count_line_blks(&txt_buf->root, n, 0, len - old_len);
+}
+
+
+void move_line_gap(_line *ln, int offset)
+{
+   //moves the gap of the line to the specified offset, only the text
+   //between the old and the new position is copied
+
+   own_line(ln);
+
+   if (offset < ln->gap)
+      memmove(&ln->txt[offset + ln->gap_len], &ln->txt[offset], ln->gap - offset);
+   else if (offset > ln->gap)
+      memmove(&ln->txt[ln->gap], &ln->txt[ln->gap + ln->gap_len], offset - ln->gap);
+
+   ln->gap = offset;
+}
+
+
+void grow_line(_line *ln, int n)
+{
+   //makes sure the gap holds at least n characters, at least doubling
+   //the storage when it has to grow so appends are amortized
+
+   own_line(ln);
+
+   if (ln->gap_len < n)
+   {
+      int size = ln->len + ln->gap_len;
+      int new_size = (2 * size > size + n) ? 2 * size : size + n;
+      int tail = ln->len - ln->gap;
+
+      new_size = (new_size < 16) ? 16 : new_size;
+      ln->txt = realloc(ln->txt, new_size * sizeof(char));
+
+      //slide the text after the gap to the end of the new storage
+      memmove(&ln->txt[new_size - tail], &ln->txt[size - tail], tail);
+      ln->gap_len = new_size - ln->len;
+   }
+}
+
+
+void del_char_from_line(_line *ln, int offset)
+{
+   //deletes the character before offset
+
+   move_line_gap(ln, offset);
+   ln->gap--;
+   ln->gap_len++;
+   ln->len--;
+}
+
+
+void add_char_to_line(_line *ln, char add, int offset)
+{
+   //inserts a character into the line
+
+   move_line_gap(ln, offset);
+   grow_line(ln, 1);
+   ln->txt[ln->gap++] = add;
+   ln->gap_len--;
+   ln->len++;
+}
+
+
+void add_char_to_line_end(_line *ln, char add, int offset)
+{
+   //inserts character beyond the end of line, padding with spaces
+
+   int pad = offset - ln->len;
+
+   move_line_gap(ln, ln->len);
+   grow_line(ln, pad + 1);
+   memset(&ln->txt[ln->gap], 32, pad);
+   ln->gap += pad;
+   ln->gap_len -= pad;
+   ln->len += pad;
+
+   add_char_to_line(ln, add, offset);
+}
+
+
+void join_lines(_line *ln, _line *next)
+{
+   //appends the text of the next line to the end of this one
+
+   move_line_gap(ln, ln->len);
+   grow_line(ln, next->len);
+   copy_line_text(next, 0, next->len, &ln->txt[ln->gap]);
+   ln->gap += next->len;
+   ln->gap_len -= next->len;
+   ln->len += next->len;
+}
+
+
+void add_text_to_line(_line *ln, char *txt, int n, int offset)
+{
+   //inserts n characters of text into the line at offset, or spaces if
+   //there's no text
+
+   move_line_gap(ln, offset);
+   grow_line(ln, n);
+
+   if (txt != NULL)
+      memcpy(&ln->txt[ln->gap], txt, n);
+   else
+      memset(&ln->txt[ln->gap], 32, n);
+
+   ln->gap += n;
+   ln->gap_len -= n;
+   ln->len += n;
+}
+
+
+_line init_text_line(char *txt, int n)
+{
+   //returns a new line holding a copy of n characters of text
+
+   _line ln = init_new_line();
+
+   if (n > 0)
+      add_text_to_line(&ln, txt, n, 0);
+
+   return(ln);
+}
+
+
+_line split_line(_line *ln, int offset)
+{
+   //cuts the line at offset, returns a new line holding the text after it
+
+   _line new_line = init_new_line();
+
+   if ((ln->shared == _SHARE_FILE) && (offset < ln->len))   //both halves stay in the file
+   {
+      new_line = *ln;
+      new_line.txt += offset;
+      new_line.len -= offset;
+      new_line.gap = new_line.len;
+      new_line.orig = (ln->orig >= 0) ? ln->orig + offset : -1;
+      ln->len = offset;
+      ln->gap = offset;
+      ln->orig = -1;
+
+      return(new_line);
+   }
+
+   grow_line(&new_line, ln->len - offset);
+   new_line.len = copy_line_text(ln, offset, ln->len - offset, new_line.txt);
+   new_line.gap = new_line.len;
+   new_line.gap_len -= new_line.len;
+   new_line.orig = (ln->orig >= 0) ? ln->orig + offset : -1;    //the end is still as it was
+
+   move_line_gap(ln, offset);
+   ln->gap_len += ln->len - offset;
+   ln->len = offset;
+   ln->orig = -1;
+
+   return(new_line);
+}
+
+
+char line_char(_line *ln, int i)
+{
+   //returns the character at offset i of the line
+
+   char ch = (i < ln->gap) ? ln->txt[i] : ln->txt[i + ln->gap_len];
+
+   return((ln->shared != _SHARE_FILE) || alphanum((unsigned char) ch) ? ch : 'X');
+}
+
+
+int copy_line_text(_line *ln, int from, int n, char *dst)
+{
+   //copies up to n characters of the line starting at offset from into dst,
+   //returns the number of characters copied
+
+   int pre = 0;
+
+   if (from + n > ln->len)
+      n = ln->len - from;
+   if (n <= 0)
+      return(0);
+
+   if (ln->shared == _SHARE_FILE)                       //straight from the file, which
+   {                                                    //may hold anything
+      scan_sanitize(dst, &ln->txt[from], n);
+      return(n);
+   }
+
+   if (from < ln->gap)                                  //part before the gap
+   {
+      pre = (ln->gap - from < n) ? ln->gap - from : n;
+      memcpy(dst, &ln->txt[from], pre);
+   }
+
+   //part after the gap
+   memcpy(&dst[pre], &ln->txt[from + pre + ln->gap_len], n - pre);
+
+   return(n);
+}
+
+
+long num_lines(_txt_buf *txt_buf)
+{
+   //returns number of lines in the buffer
+
+   return((txt_buf->root != NULL) ? txt_buf->root->n_lines : 0);
+}
+
+
+int alphanum(int ch)
+{
+   //returns TRUE if ch represents alphanumerical ASCII value
+
+   return((ch >= 32) && (ch <= 126));
+}
+
+
+int copy_sanitized(char *dst, char *src, long n)
+{
+   //copies n characters, replacing the non-displayable ones with 'X'; with
+   //no dst it only checks. returns TRUE if there were any to replace
+
+   long i;
+   int bad = FALSE;
+
+   for (i = 0; i < n; i++)
+   {
+      bad |= !alphanum((unsigned char) src[i]);
+      if (dst != NULL)
+         dst[i] = alphanum((unsigned char) src[i]) ? src[i] : 'X';
+   }
+
+   return(bad);
+}
+
+
+int find_newlines(char *src, int n, int *pos)
+{
+   //records the offsets of the newlines among n characters in pos,
+   //returns how many were found
+
+   int i, count = 0;
+
+   for (i = 0; i < n; i++)
+      if (src[i] == '\n')
+         pos[count++] = i;
+
+   return(count);
+}
+
+
+long find_text(char *src, long n, char *txt, int len)
+{
+   //returns the offset of the first occurrence of txt among n characters,
+   //or -1 if it isn't there
+
+   char *at;
+   long i;
+
+   for (i = 0; i + len <= n; i = at - src + 1)
+   {
+      if ((at = memchr(&src[i], txt[0], n - len + 1 - i)) == NULL)
+         break;
+      if (memcmp(at, txt, len) == 0)
+         return(at - src);
+   }
+
+   return(-1);
+}
+
+
+long find_last_text(char *src, long n, char *txt, int len)
+{
+   //returns the offset of the last occurrence of txt among n characters,
+   //or -1 if it isn't there
+
+   long i;
+
+   for (i = n - len; i >= 0; i--)
+      if ((src[i] == txt[0]) && (memcmp(&src[i], txt, len) == 0))
+         return(i);
+
+   return(-1);
+}
+
+
+#ifdef _SCAN_SIMD
+
+//the same two kernels, 16 and 32 characters at a time; displayable characters
+//are the signed bytes between 31 and 127, anything else compares out of range
+
+int copy_sanitized_sse2(char *dst, char *src, long n)
+{
+   __m128i lo = _mm_set1_epi8(31), hi = _mm_set1_epi8(127), x = _mm_set1_epi8('X');
+   __m128i all = _mm_set1_epi8(-1);
+   long i;
+
+   for (i = 0; i + 16 <= n; i += 16)
+   {
+      __m128i v = _mm_loadu_si128((__m128i*) &src[i]);
+      __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+
+      all = _mm_and_si128(all, ok);
+      if (dst != NULL)
+         _mm_storeu_si128((__m128i*) &dst[i],
+                          _mm_or_si128(_mm_and_si128(ok, v), _mm_andnot_si128(ok, x)));
+   }
+
+   return((_mm_movemask_epi8(all) != 0xffff) |
+          copy_sanitized((dst != NULL) ? &dst[i] : NULL, &src[i], n - i));
+}
+
+
+int find_newlines_sse2(char *src, int n, int *pos)
+{
+   __m128i nl = _mm_set1_epi8('\n');
+   int i, count = 0;
+
+   for (i = 0; i + 16 <= n; i += 16)
+   {
+      unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) &src[i]), nl));
+
+      for (; m != 0; m &= m - 1)
+         pos[count++] = i + __builtin_ctz(m);
+   }
+
+   for (; i < n; i++)                        //the rest, one at a time
+      if (src[i] == '\n')
+         pos[count++] = i;
+
+   return(count);
+}
+
+
+__attribute__((target("avx2")))
+int copy_sanitized_avx2(char *dst, char *src, long n)
+{
+   __m256i lo = _mm256_set1_epi8(31), hi = _mm256_set1_epi8(127), x = _mm256_set1_epi8('X');
+   __m256i all = _mm256_set1_epi8(-1);
+   long i;
+
+   for (i = 0; i + 32 <= n; i += 32)
+   {
+      __m256i v = _mm256_loadu_si256((__m256i*) &src[i]);
+      __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+
+      all = _mm256_and_si256(all, ok);
+      if (dst != NULL)
+         _mm256_storeu_si256((__m256i*) &dst[i], _mm256_blendv_epi8(x, v, ok));
+   }
+
+   return(((unsigned int) _mm256_movemask_epi8(all) != 0xffffffff) |
+          copy_sanitized_sse2((dst != NULL) ? &dst[i] : NULL, &src[i], n - i));
+}
+
+
+__attribute__((target("avx2")))
+int find_newlines_avx2(char *src, int n, int *pos)
+{
+   __m256i nl = _mm256_set1_epi8('\n');
+   int i, count = 0;
+
+   for (i = 0; i + 32 <= n; i += 32)
+   {
+      unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*) &src[i]), nl));
+
+      for (; m != 0; m &= m - 1)
+         pos[count++] = i + __builtin_ctz(m);
+   }
+
+   for (; i < n; i++)                        //the rest, one at a time
+      if (src[i] == '\n')
+         pos[count++] = i;
+
+   return(count);
+}
+
+
+//finding text: the positions where both its first and its last character
+//match are picked out 16 or 32 at a time, only those are compared in full.
+//the positions left over at the end are picked out of the last 16 or 32,
+//what's too short for that goes to the narrower kernel
+
+long find_text_sse2(char *src, long n, char *txt, int len)
+{
+   __m128i first = _mm_set1_epi8(txt[0]), last = _mm_set1_epi8(txt[len - 1]);
+   long i, at = n - len + 1;                      //positions it could start at
+   unsigned int m;
+
+   if (at < 16)
+      return(find_text(src, n, txt, len));
+
+   for (i = 0; i < at; i += 16)
+   {
+      if (i + 16 > at)                            //the last 16, not again the ones before
+      {
+         m = 0xffff << (i - (at - 16));
+         i = at - 16;
+      }
+      else
+         m = 0xffff;
+
+      m &= _mm_movemask_epi8(_mm_and_si128(
+              _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) &src[i]), first),
+              _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) &src[i + len - 1]), last)));
+
+      for (; m != 0; m &= m - 1)
+         if (memcmp(&src[i + __builtin_ctz(m)], txt, len) == 0)
+            return(i + __builtin_ctz(m));
+   }
+
+   return(-1);
+}
+
+
+long find_last_text_sse2(char *src, long n, char *txt, int len)
+{
+   __m128i first = _mm_set1_epi8(txt[0]), last = _mm_set1_epi8(txt[len - 1]);
+   long i = n - len + 1;                          //positions it could start at
+   unsigned int m;
+
+   if (i < 16)
+      return(find_last_text(src, n, txt, len));
+
+   while (i > 0)
+   {
+      m = (i < 16) ? (1u << i) - 1 : 0xffff;      //the first 16, not again the ones after
+      i = (i < 16) ? 0 : i - 16;
+
+      m &= _mm_movemask_epi8(_mm_and_si128(
+              _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) &src[i]), first),
+              _mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) &src[i + len - 1]), last)));
+
+      for (; m != 0; m &= ~(1u << (31 - __builtin_clz(m))))
+         if (memcmp(&src[i + 31 - __builtin_clz(m)], txt, len) == 0)
+            return(i + 31 - __builtin_clz(m));
+   }
+
+   return(-1);
+}
+
+
+__attribute__((target("avx2")))
+long find_text_avx2(char *src, long n, char *txt, int len)
+{
+   __m256i first = _mm256_set1_epi8(txt[0]), last = _mm256_set1_epi8(txt[len - 1]);
+   long i, at = n - len + 1;
+   unsigned int m;
+
+   if (at < 32)
+      return(find_text_sse2(src, n, txt, len));
+
+   for (i = 0; i < at; i += 32)
+   {
+      if (i + 32 > at)
+      {
+         m = 0xffffffff << (i - (at - 32));
+         i = at - 32;
+      }
+      else
+         m = 0xffffffff;
+
+      m &= _mm256_movemask_epi8(_mm256_and_si256(
+              _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*) &src[i]), first),
+              _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*) &src[i + len - 1]), last)));
+
+      for (; m != 0; m &= m - 1)
+         if (memcmp(&src[i + __builtin_ctz(m)], txt, len) == 0)
+            return(i + __builtin_ctz(m));
+   }
+
+   return(-1);
+}
+
+
+__attribute__((target("avx2")))
+long find_last_text_avx2(char *src, long n, char *txt, int len)
+{
+   __m256i first = _mm256_set1_epi8(txt[0]), last = _mm256_set1_epi8(txt[len - 1]);
+   long i = n - len + 1;
+   unsigned int m;
+
+   if (i < 32)
+      return(find_last_text_sse2(src, n, txt, len));
+
+   while (i > 0)
+   {
+      m = (i < 32) ? (1u << i) - 1 : 0xffffffff;
+      i = (i < 32) ? 0 : i - 32;
+
+      m &= _mm256_movemask_epi8(_mm256_and_si256(
+              _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*) &src[i]), first),
+              _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i*) &src[i + len - 1]), last)));
+
+      for (; m != 0; m &= ~(1u << (31 - __builtin_clz(m))))
+         if (memcmp(&src[i + 31 - __builtin_clz(m)], txt, len) == 0)
+            return(i + 31 - __builtin_clz(m));
+   }
+
+   return(-1);
+}
+
+#endif
+
+
+void init_scan_kernels()
+{
+   //picks the widest scanning kernels the processor supports
+
+#ifdef _SCAN_SIMD
+   __builtin_cpu_init();
+
+   scan_kernel = "sse2";
+   scan_newlines = find_newlines_sse2;
+   scan_sanitize = copy_sanitized_sse2;
+   scan_find = find_text_sse2;
+   scan_find_last = find_last_text_sse2;
+
+   if (__builtin_cpu_supports("avx2"))
+   {
+      scan_kernel = "avx2";
+      scan_newlines = find_newlines_avx2;
+      scan_sanitize = copy_sanitized_avx2;
+      scan_find = find_text_avx2;
+      scan_find_last = find_last_text_avx2;
+   }
+#endif
+}
+
+
+double get_time()
+{
+   //returns a monotonic time in seconds, for timing loads and saves
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return(ts.tv_sec + (ts.tv_nsec / 1e9));
+}
+
+
+int parse_input(int c, char **v, char **open_file)
+{
+   //parses input arguments, returns appropriate mode and sets the
+   //file to open if one was specified
+
+   int mode = 0;
+   int i = 1;
+
+   for (; (i < c) && (v[i][0] == '-') && (v[i][1] != '\0'); i++)  //options first
+   {
+      if ((strcmp(v[i], "-j") == 0) && (i + 1 < c))  //number of loading threads
+         load_threads = atoi(v[++i]);
+      else if ((strcmp(v[i], "-u") == 0) && (i + 1 < c))   //megabytes of undo history
+         undo_cap = atol(v[++i]) << 20;
+      else if (strcmp(v[i], "-R") == 0)             //view only
+         view_only = map_lines = TRUE;
+      else if (strcmp(v[i], "-P") == 0)             //edit on top of the mapped file
+         map_lines = TRUE;
+      else if (strcmp(v[i], "-t") == 0)             //index trigrams for finding
+         index_trigrams = TRUE;
+      else
+         c = -1;                              //unknown option, show the format
+   }
+
+   if (c == i)                                //if no command line arguments,
+   {                                          //set default _bufdump mode
+      mode = _MD_BUF;
+   }
+   else if (c == i + 1)                       //file specified
+   {
+      char ch[80];
+
+      *open_file = v[i];
+
+      if (access(v[i], F_OK) != 0)            //check if file specified exists
+      {
+         //confirm we want to create the new file
+         printf("\nfile does not exist; create");
+         while ((ch[0] != 'y') && (ch[0] != 'n') && (ch[0] != 'Y') && (ch[0] != 'N'))
+         {
+            printf(" (y/n)? ");
+            scanf("%79s", ch);
+         }
+
+         if ((ch[0] == 'y') || (ch[0] == 'Y'))
+            mode = _MD_NEW;
+         else
+            mode = _MD_QUIT;
+      }
+      else                                    //everything worked fine, file exists
+         mode = _MD_OPEN;
+   }
+   else
+   {
+      printf("\ncommand line format: noir [-R | -P] [-t] [-j threads] [-u megabytes] filepath\n");
+      mode = _MD_QUIT;
+   }
+
+   return(mode);
+}
+
+
+void load_file(_txt_buf *txt_buf, char *filename)
+{
+   //loads an ascii text file into the buffer, mapping it into memory
+   //(or reading it in large blocks) and splitting it into lines in one pass;
+   //for large files only the first lines are loaded right away, enough to
+   //show the first screen, and the rest loads on a thread in the background
+
+   struct stat st;
+   char *data = NULL, *first = NULL;
+   long size = 0, i;
+   int mapped = FALSE, threads;
+   double start = get_time();
+   int fd = open(filename, O_RDONLY);
+
+   if (fd == -1)
+   {
+      printf("\nerror opening file.\n");
+      exit(0);
+   }
+
+   if (fstat(fd, &st) != 0)
+      st.st_mode = 0;
+
+   if (S_ISREG(st.st_mode) && (st.st_size > 0))
+   {
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED)
+         data = NULL;
+      else
+      {
+         size = st.st_size;
+         mapped = TRUE;
+         madvise(data, size, MADV_SEQUENTIAL);
+      }
+   }
+
+   if (data == NULL)                         //can't map it, read it in blocks
+   {
+      long cap = 0, got;
+
+      do
+      {
+         if (size == cap)
+         {
+            cap = (cap == 0) ? (1 << 20) : 2 * cap;
+            data = realloc(data, cap);
+         }
+         got = read(fd, &data[size], cap - size);
+         size += (got > 0) ? got : 0;
+      } while (got > 0);
+   }
+
+   free_line_blks(txt_buf->root);            //replace whatever was in the buffer
+   txt_buf->root = NULL;
+   txt_buf->hint = NULL;
+   release_file(txt_buf);
+
+   if (txt_buf->base != -1)
+      close(txt_buf->base);
+
+   if (S_ISREG(st.st_mode) && (size == st.st_size))     //keep it to copy unedited lines
+   {                                                    //from when saving
+      txt_buf->base = fd;
+      txt_buf->base_size = size;
+      txt_buf->base_time = st.st_mtim;
+   }
+   else
+   {
+      close(fd);
+      txt_buf->base = -1;
+   }
+
+   if ((index_trigrams) && (txt_buf->base != -1))      //its index, or a new one
+      open_trigrams(filename, &st);
+
+   if (map_lines)                            //the lines will point into it, keep it
+   {
+      txt_buf->file = data;
+      txt_buf->file_size = size;
+      txt_buf->file_mapped = mapped;
+   }
+
+   //find where the first lines end, large files load the rest later
+   for (i = 0, first = data; (size > _LOAD_BATCH) && (i < _LOAD_FIRST) && (first != NULL); i++)
+      if ((first = memchr(first, '\n', &data[size] - first)) != NULL)
+         first++;
+
+   if ((first != NULL) && (first != data) && (first < &data[size]))
+   {
+      _loader *ld = malloc(sizeof(_loader));
+
+      load_lines(txt_buf, data, first - data - 1, (txt_buf->base != -1) ? 0 : -1);
+
+      pthread_mutex_init(&ld->lock, NULL);
+      pthread_cond_init(&ld->more, NULL);
+      ld->data = data;
+      ld->size = size;
+      ld->mapped = mapped;
+      ld->kept = (txt_buf->base != -1);
+      ld->done = first - data;
+      ld->finished = FALSE;
+      ld->lines = NULL;
+      ld->start = start;
+
+      if (pthread_create(&ld->thread, NULL, load_rest, ld) == 0)
+      {
+         txt_buf->loading = ld;
+         sprintf(status_msg, "loading %ld%%...", (100 * ld->done) / size);
+         return;
+      }
+
+      load_rest(ld);                         //no thread to be had, finish it here
+      txt_buf->root = merge_line_blks(txt_buf->root, ld->lines);
+      threads = ld->threads;
+      free(ld);
+   }
+   else
+      threads = load_lines(txt_buf, data, size, (txt_buf->base != -1) ? 0 : -1);
+
+   if (map_lines)                            //the lines point into it, keep it...
+   {
+      if (mapped)                            //...but its pages can go until drawn
+         madvise(data, size, MADV_DONTNEED);
+   }
+   else if (mapped)
+      munmap(data, size);
+   else
+      free(data);
+
+   start = get_time() - start;
+   sprintf(status_msg, "loaded %.1f MB in %.3f s, %.1f MB/s (%s, %d thread%s)", size / 1e6,
+           start, (start > 0) ? size / 1e6 / start : 0.0, scan_kernel, threads,
+           (threads > 1) ? "s" : "");
+   if (index_trigrams)
+      close_trigrams(txt_buf);
+}
+
+
+void release_file(_txt_buf *txt_buf)
+{
+   //lets go of the file the buffer's shared lines pointed into
+
+   if (txt_buf->file == NULL)
+      return;
+
+   if (txt_buf->file_mapped)
+      munmap(txt_buf->file, txt_buf->file_size);
+   else
+      free(txt_buf->file);
+
+   txt_buf->file = NULL;
+   txt_buf->file_size = 0;
+}
+
+
+int load_lines(_txt_buf *txt_buf, char *data, long size, long at)
+{
+   //splits the text into lines at the newlines and appends them to the
+   //buffer; the text is shared out between the loading threads, which
+   //find the newlines in their shares, then build their shares of the lines.
+   //the text is at offset at in the file, -1 if it isn't kept for saving;
+   //returns the number of threads used
+
+   int i, n = (load_threads > 0) ? load_threads : sysconf(_SC_NPROCESSORS_ONLN);
+   _load_job *jobs;
+   long *ends, count = 0;
+
+   n = (n < 1) ? 1 : n;
+   n = (size / n < _LOAD_SHARE) ? (size / _LOAD_SHARE) + 1 : n;
+   jobs = malloc(n * sizeof(_load_job));
+
+   for (i = 0; i < n; i++)                   //find the newlines
+   {
+      jobs[i].data = data;
+      jobs[i].at = at;
+      jobs[i].from = (size / n) * i;
+      jobs[i].to = (i == n - 1) ? size : (size / n) * (i + 1);
+   }
+   run_jobs(jobs, n, sizeof(_load_job), scan_load_job);
+
+   //stitch the newlines of all shares together; the last line ends
+   //at the end of the file
+   for (i = 0; i < n; i++)
+      count += jobs[i].count;
+   ends = malloc((count + 1) * sizeof(long));
+
+   for (i = 0, count = 0; i < n; i++)
+   {
+      memcpy(&ends[count], jobs[i].nl, jobs[i].count * sizeof(long));
+      count += jobs[i].count;
+      free(jobs[i].nl);
+   }
+   ends[count] = size;
+
+   for (i = 0; i < n; i++)                   //build the lines
+   {
+      jobs[i].ends = ends;
+      jobs[i].first = ((count + 1) / n) * i;
+      jobs[i].last = (i == n - 1) ? count + 1 : ((count + 1) / n) * (i + 1);
+   }
+   run_jobs(jobs, n, sizeof(_load_job), build_load_job);
+
+   for (i = 0; i < n; i++)
+   {
+      save_trigrams(jobs[i].lines.root);
+      txt_buf->root = merge_line_blks(txt_buf->root, jobs[i].lines.root);
+   }
+
+   free(ends);
+   free(jobs);
+
+   return(n);
+}
+
+
+void *load_rest(void *loader)
+{
+   //loading thread, loads the rest of the file a batch at a time; each
+   //batch ends at a newline and is handed over for attaching to the buffer
+
+   _loader *ld = loader;
+   long start = ld->done;
+
+   while (TRUE)
+   {
+      _txt_buf batch = {NULL, NULL, NULL, 0, NULL, 0, NULL, 0, FALSE, -1, 0, {0, 0}, NULL, NULL};
+      long end = (ld->size - start > _LOAD_BATCH) ? start + _LOAD_BATCH : ld->size;
+      char *nl;
+
+      if (end < ld->size)                    //end the batch on a newline
+      {
+         if ((nl = memchr(&ld->data[end], '\n', ld->size - end)) != NULL)
+            end = nl - ld->data;
+         else
+            end = ld->size;
+      }
+
+      ld->threads = load_lines(&batch, &ld->data[start], end - start, (ld->kept) ? start : -1);
+
+      if ((map_lines) && (ld->mapped))       //indexed, its pages can go until drawn
+      {
+         long page = start & ~((long) sysconf(_SC_PAGESIZE) - 1);
+         madvise(&ld->data[page], end - page, MADV_DONTNEED);
+      }
+
+      pthread_mutex_lock(&ld->lock);
+      ld->lines = merge_line_blks(ld->lines, batch.root);
+      ld->done = end;
+      ld->finished = (end == ld->size);
+      pthread_cond_signal(&ld->more);
+      pthread_mutex_unlock(&ld->lock);
+
+      wake_input();
+
+      if (end == ld->size)
+         return(NULL);
+      start = end + 1;
+   } //while
+}
+
+
+int attach_loaded_lines(_txt_buf *txt_buf)
+{
+   //attaches the lines loaded in the background since the last call to the
+   //end of the buffer, and cleans up once all of the file is in; returns
+   //TRUE if any lines were attached
+
+   _loader *ld = txt_buf->loading;
+   _line_blk *lines;
+   double time;
+
+   if (ld == NULL)
+      return(FALSE);
+
+   pthread_mutex_lock(&ld->lock);
+   lines = ld->lines;
+   ld->lines = NULL;
+   sprintf(status_msg, "loading %ld%%...", (100 * ld->done) / ld->size);
+   pthread_mutex_unlock(&ld->lock);
+
+   if (lines != NULL)
+      dirty_lines(num_lines(txt_buf), LONG_MAX);
+   txt_buf->root = merge_line_blks(txt_buf->root, lines);
+
+   if (ld->finished)                         //all in, clean up
+   {
+      pthread_join(ld->thread, NULL);
+      pthread_mutex_destroy(&ld->lock);
+      pthread_cond_destroy(&ld->more);
+
+      if (!map_lines)                        //the lines point into it otherwise
+      {
+         if (ld->mapped)
+            munmap(ld->data, ld->size);
+         else
+            free(ld->data);
+      }
+
+      time = get_time() - ld->start;
+      sprintf(status_msg, "loaded %.1f MB in %.3f s, %.1f MB/s (%s, %d thread%s)",
+              ld->size / 1e6, time, (time > 0) ? ld->size / 1e6 / time : 0.0, scan_kernel,
+              ld->threads, (ld->threads > 1) ? "s" : "");
+      if (index_trigrams)
+         close_trigrams(txt_buf);
+
+      free(ld);
+      txt_buf->loading = NULL;
+   }
+
+   return(lines != NULL);
+}
+
+
+void wait_for_lines(_txt_buf *txt_buf, long n)
+{
+   //blocks until line n of the file is loaded, or all of it if there
+   //are fewer lines
+
+   while ((txt_buf->loading != NULL) && (num_lines(txt_buf) <= n))
+   {
+      _loader *ld = txt_buf->loading;
+
+      pthread_mutex_lock(&ld->lock);
+      while ((ld->lines == NULL) && (!ld->finished))
+         pthread_cond_wait(&ld->more, &ld->lock);
+      pthread_mutex_unlock(&ld->lock);
+
+      attach_loaded_lines(txt_buf);
+   } //while
+}
+
+
+void run_jobs(void *jobs, int n, int size, void *(*work)(void *))
+{
+   //runs the work on every one of the n jobs of size bytes, each on a thread
+   //of its own, and waits for all of them to finish; a single job runs on the
+   //calling thread
+
+   pthread_t *threads = malloc(n * sizeof(pthread_t));
+   int *started = malloc(n * sizeof(int));
+   int i;
+
+   for (i = 1; i < n; i++)
+      started[i] = (pthread_create(&threads[i], NULL, work, (char*) jobs + i * size) == 0);
+
+   work(jobs);
+
+   for (i = 1; i < n; i++)
+      if (started[i])
+         pthread_join(threads[i], NULL);
+      else                                   //no thread to be had, do it here
+         work((char*) jobs + i * size);
+
+   free(started);
+   free(threads);
+}
+
+
+void *scan_load_job(void *job)
+{
+   //finds the newlines in a share of the file, a window at a time
+
+   _load_job *jb = job;
+   int *pos = malloc(_SCAN_WINDOW * sizeof(int));
+   long size = 0, off;
+
+   jb->nl = NULL;
+   jb->count = 0;
+
+   for (off = jb->from; off < jb->to; off += _SCAN_WINDOW)
+   {
+      int n = (jb->to - off < _SCAN_WINDOW) ? jb->to - off : _SCAN_WINDOW;
+      int i, found = scan_newlines(&jb->data[off], n, pos);
+
+      if (jb->count + found > size)
+      {
+         size = 2 * size + found;
+         jb->nl = realloc(jb->nl, size * sizeof(long));
+      }
+
+      for (i = 0; i < found; i++)
+         jb->nl[jb->count++] = off + pos[i];
+   } //for
+
+   free(pos);
+   return(NULL);
+}
+
+
+void *build_load_job(void *job)
+{
+   //builds a share of the lines of the file into a line tree of its own
+
+   _load_job *jb = job;
+   _line_blk *blk = init_line_blk();
+   long i;
+
+   jb->lines.root = NULL;
+
+   for (i = jb->first; i < jb->last; i++)
+   {
+      long start = (i == 0) ? 0 : jb->ends[i - 1] + 1;
+
+      blk = load_line(&jb->lines, blk, &jb->data[start], jb->ends[i] - start,
+                      (jb->at >= 0) ? jb->at + start : -1);
+   }
+
+   if (blk->count > 0)
+      append_line_blk(&jb->lines, blk);
+   else
+      free(blk);
+
+   return(NULL);
+}
+
+
+_line_blk *load_line(_txt_buf *txt_buf, _line_blk *blk, char *src, long len, long orig)
+{
+   //copies a line of loaded text into the block being filled, attaching the
+   //block to the buffer once full; returns the block to fill next. when
+   //mapping lines nothing is copied, the line just points at the text in the file.
+   //orig is where the line is in the file, it's only kept if the text needed
+   //no sanitizing
+
+   _line ln = init_new_line();
+   int bad = FALSE;
+
+   if ((len > 0) && (map_lines))
+   {
+      ln.txt = src;
+      ln.len = len;
+      ln.gap = len;
+      ln.shared = _SHARE_FILE;
+      bad = ((orig >= 0) && (scan_sanitize(NULL, src, len)));
+   }
+   else if (len > 0)
+   {
+      ln.txt = malloc(len * sizeof(char));
+      bad = scan_sanitize(ln.txt, src, len);
+      ln.len = len;
+      ln.gap = len;
+   }
+
+   ln.orig = (bad) ? -1 : orig;
+
+   return(append_line(txt_buf, blk, ln));
+}
+
+
+_line_blk *append_line(_txt_buf *txt_buf, _line_blk *blk, _line ln)
+{
+   //adds a line to the block being filled, attaching the block to the
+   //buffer once full; returns the block to fill next
+
+   if (blk->count == 0)                      //the block runs on in the file from
+      blk->orig = ln.orig;                   //its first line, as long as it can
+   else if ((blk->orig >= 0) && (ln.orig != blk->orig + blk->bytes))
+      blk->orig = -1;
+
+   blk->line[blk->count++] = ln;
+   blk->bytes += ln.len + 1;
+
+   if (blk->count == _BLK_LINES)
+   {
+      append_line_blk(txt_buf, blk);
+      blk = init_line_blk();
+   }
+
+   return(blk);
+}
+
+
+int save_file(_txt_buf *txt_buf, char *filename, int saved, int exiting)
+{
+   //saves the buffer to an ascii text file
+
+   int success = saved;
+   int save = !exiting;
+
+   if ((exiting) && (!success))          //if we're exiting and buffer is unsaved
+   {
+      if (strcmp(filename, _BUFDUMP))
+         save = show_bool_query("save (y/n)? ");
+      else                               //if we're editing _BUFDUMP, no choice
+         save = TRUE;                    //since both choices save to _bufdump
+
+      if (!save)                         //if we're not saving...
+      {
+         success = TRUE;                 //save anyway to _BUFDUMP
+
+         filename = realloc(filename, 60 * sizeof(char));
+         filename = _BUFDUMP;
+      }
+   } //if
+
+   wait_for_lines(txt_buf, LONG_MAX);    //all of the file must be in to save it
+   finish_save(txt_buf, TRUE);           //and one save at a time
+
+   if (TRUE)                             //*** DEBUG/MOD: for later modification
+   {
+      _saver *sv = start_save(txt_buf, filename);
+
+      if (sv == NULL)
+         strcpy(status_msg, "error opening file.");
+      else if ((exiting) || (pthread_create(&sv->thread, NULL, write_snapshot, sv) != 0))
+      {
+         write_snapshot(sv);             //have to wait for it
+         success = finish_save(txt_buf, TRUE);
+      }
+      else                               //keep editing while it's written
+      {
+         sv->threaded = TRUE;
+         strcpy(status_msg, "saving...");
+         success = FALSE;
+      }
+   } //if
+
+   return(success);
+}
+
+
+_saver *start_save(_txt_buf *txt_buf, char *filename)
+{
+   //freezes the buffer as it is for saving, and opens the file it gets
+   //written to. if the unedited lines are all still where they were in the
+   //file as loaded, only the edited text needs writing over it; otherwise a
+   //new file is made next to it, to be renamed over it once written, with
+   //the unedited text copied across from the file as loaded. returns NULL if
+   //the file can't be opened
+
+   _saver *sv = malloc(sizeof(_saver));
+   _save_batch *bt = &sv->batch;
+   struct stat st, base;
+   int mode = 0666, found = (stat(filename, &st) == 0);
+   char *target = realpath(filename, NULL);     //a link's file is saved, not the link
+   char *slash;
+
+   if (target == NULL)                          //not there yet
+      target = strdup(filename);
+   slash = strrchr(target, '/');
+
+   if (found)
+      mode = st.st_mode & 07777;
+
+   bt->base = -1;
+   if ((txt_buf->base != -1) && (fstat(txt_buf->base, &base) == 0) &&
+       (base.st_size == txt_buf->base_size) && (base.st_mtim.tv_sec == txt_buf->base_time.tv_sec) &&
+       (base.st_mtim.tv_nsec == txt_buf->base_time.tv_nsec))
+   {
+      bt->base = txt_buf->base;                 //not changed since, still of use
+      bt->base_size = txt_buf->base_size;
+   }
+
+   //see if it can be saved in place; not when lines point into the file, or
+   //when so much has changed a crash halfway would leave a real mess
+   bt->pass = _SV_CHECK;
+   bt->fits = ((bt->base != -1) && (found) && (st.st_dev == base.st_dev) &&
+               (st.st_ino == base.st_ino) && (!map_lines));
+   bt->at = 0;
+   bt->bytes = 0;
+   bt->lines = num_lines(txt_buf);
+   if (bt->fits)
+      save_line_blks(txt_buf->root, bt);
+
+   sv->path = NULL;
+   bt->pass = _SV_PATCH;
+   if ((!bt->fits) || (bt->at != bt->base_size) || (bt->bytes > _SAVE_PATCH) ||
+       ((bt->fd = open(filename, O_WRONLY)) == -1))
+   {
+      sv->path = malloc(strlen(target) + 8);
+      sprintf(sv->path, "%s.noir~", target);    //next to it, so renaming is atomic
+      bt->pass = _SV_WRITE;
+
+      if ((bt->fd = open(sv->path, O_WRONLY | O_CREAT | O_TRUNC, mode)) == -1)
+      {
+         free(sv->path);
+         free(target);
+         free(sv);
+         return(NULL);
+      }
+      if (found)                                //a new file gets the umask applied
+         fchmod(bt->fd, mode);
+   }
+
+   pthread_mutex_init(&sv->lock, NULL);
+   sv->threaded = FALSE;
+   sv->finished = FALSE;
+   sv->root = txt_buf->root;
+   sv->filename = filename;
+   sv->target = target;
+   sv->dir = (slash != NULL) ? strndup(target, (slash == target) ? 1 : slash - target)
+                             : strdup(".");
+   bt->at = 0;
+   bt->stage = malloc(_SAVE_STAGE);
+   bt->staged = 0;
+   bt->run_from = 0;
+   bt->run_len = 0;
+   bt->lines = num_lines(txt_buf);
+   bt->bytes = 0;
+   bt->copied = 0;
+   bt->error = FALSE;
+   sv->changes = txt_buf->changes;
+   sv->start = get_time();
+
+   snap_gen = blk_gen++;                        //every block there is now is frozen
+   txt_buf->saving = sv;
+
+   if (txt_buf->journal != NULL)                //edits after this aren't in the file
+   {
+      flush_journal(txt_buf->journal);
+      txt_buf->journal->saved_at = txt_buf->journal->size;
+   }
+
+   return(sv);
+}
+
+
+void *write_snapshot(void *saver)
+{
+   //saving thread, writes the snapshot to the temporary file, makes sure
+   //it's on disk and renames it over the file being saved; a crash at any
+   //point leaves either the old file or the new one. saving in place only
+   //the edited text is written, over the file itself
+
+   _saver *sv = saver;
+   _save_batch *bt = &sv->batch;
+   int fd;
+
+   save_line_blks(sv->root, bt);                //write the lines out, in large batches
+   flush_save_batch(bt, NULL);
+   flush_save_run(bt);
+
+   bt->error = ((bt->error) || (fsync(bt->fd) != 0));
+   bt->error = ((close(bt->fd) != 0) || (bt->error));
+
+   if (sv->path == NULL)                        //saved in place, nothing to rename
+      ;
+   else if ((bt->error) || (rename(sv->path, sv->target) != 0))
+   {
+      bt->error = TRUE;
+      unlink(sv->path);
+   }
+   else if ((fd = open(sv->dir, O_RDONLY)) != -1)   //and the rename itself on disk
+   {
+      fsync(fd);
+      close(fd);
+   }
+
+   pthread_mutex_lock(&sv->lock);
+   sv->finished = TRUE;
+   pthread_mutex_unlock(&sv->lock);
+
+   wake_input();
+
+   return(NULL);
+}
+
+
+int finish_save(_txt_buf *txt_buf, int wait)
+{
+   //cleans up after a save once it's written, or waits for it if asked to;
+   //returns TRUE if it saved the buffer as it still is
+
+   _saver *sv = txt_buf->saving;
+   _save_batch *bt;
+   struct stat st;
+   double time;
+   int success;
+
+   if (sv == NULL)
+      return(FALSE);
+
+   pthread_mutex_lock(&sv->lock);
+   success = sv->finished;
+   pthread_mutex_unlock(&sv->lock);
+
+   if ((!success) && (!wait))
+      return(FALSE);
+
+   if (sv->threaded)
+      pthread_join(sv->thread, NULL);
+   pthread_mutex_destroy(&sv->lock);
+
+   //the snapshot is done with, hand its text back to the buffer
+   thaw_lines(txt_buf->root);
+   while (n_retired > 0)
+      free(retired[--n_retired]);
+   snap_gen = -1;
+
+   bt = &sv->batch;
+   time = get_time() - sv->start;
+   if (bt->error)
+      strcpy(status_msg, "error saving file.");
+   else if (sv->path == NULL)
+      sprintf(status_msg, "saved %.1f MB in %.3f s, %.1f KB of it changed in place", bt->at / 1e6,
+              time, bt->bytes / 1e3);
+   else
+      sprintf(status_msg, "saved %.1f MB in %.3f s, %.1f MB/s (%.1f MB copied)", bt->at / 1e6,
+              time, (time > 0) ? bt->at / 1e6 / time : 0.0, bt->copied / 1e6);
+
+   //the file as loaded was written over in place, it's still the same file
+   if ((sv->path == NULL) && (fstat(txt_buf->base, &st) == 0))
+      txt_buf->base_time = st.st_mtim;
+
+   success = ((!bt->error) && (sv->changes == txt_buf->changes));
+
+   if (!bt->error)                              //the journal can start over from it
+      restart_journal(txt_buf, sv->filename);
+
+   free(sv->batch.stage);
+   free(sv->path);
+   free(sv->target);
+   free(sv->dir);
+   free(sv);
+   txt_buf->saving = NULL;
+
+   return(success);
+}
+
+
+void save_line_blks(_line_blk *blk, _save_batch *sv)
+{
+   //writes out the lines of the tree in order; text unedited since loading
+   //is copied from the file as loaded, a whole block of it at a time where it
+   //can be, edited lines are written from the buffer
+
+   int i, nl;
+
+   if ((blk == NULL) || ((sv->pass == _SV_CHECK) && (!sv->fits)))
+      return;
+
+   save_line_blks(blk->lf, sv);
+
+   if ((blk->orig >= 0) && (sv->base != -1) && (blk->count < sv->lines))
+   {
+      save_span(sv, blk->orig, blk->bytes);     //all of it as it was, with newlines
+      sv->lines -= blk->count;
+   }
+   else
+   {
+      for (i = 0; i < blk->count; i++)
+      {
+         _line *ln = &blk->line[i];
+
+         nl = (--sv->lines > 0);                //the last line gets no newline
+
+         if ((ln->orig >= 0) && (sv->base != -1))
+            save_span(sv, ln->orig, ln->len + nl);
+         else
+            save_text(sv, ln, nl);
+      }
+   } //else
+
+   save_line_blks(blk->rt, sv);
+}
+
+
+void save_text(_save_batch *sv, _line *ln, int nl)
+{
+   //writes out the text of an edited line, followed by a newline if nl
+   //(just the newline if there's no line); short lines are gathered into
+   //large writes, long ones are written straight from their storage
+
+   int from, n, len = (ln != NULL) ? ln->len : 0;
+
+   if (sv->pass == _SV_CHECK)
+   {
+      sv->at += len + nl;
+      sv->bytes += len + nl;
+      return;
+   }
+
+   flush_save_run(sv);                       //what comes before it first
+
+   if ((len >= _SAVE_DIRECT) && (ln->shared != _SHARE_FILE))
+      flush_save_batch(sv, ln);
+   else                                      //copy it in, a piece at a time if
+   {                                         //it doesn't fit
+      for (from = 0; from < len; from += n)
+      {
+         if (sv->staged == _SAVE_STAGE)
+            flush_save_batch(sv, NULL);
+
+         n = copy_line_text(ln, from, _SAVE_STAGE - sv->staged, &sv->stage[sv->staged]);
+         sv->staged += n;
+      }
+   }
+
+   if (nl)
+   {
+      if (sv->staged == _SAVE_STAGE)
+         flush_save_batch(sv, NULL);
+      sv->stage[sv->staged++] = '\n';
+   }
+}
+
+
+void save_span(_save_batch *sv, long from, long len)
+{
+   //puts len bytes of unedited text at offset from in the file as loaded
+   //next; saving in place it's already there, otherwise it's copied across,
+   //runs of it that follow on in the file in one go
+
+   int nl = FALSE;
+
+   if (from + len > sv->base_size)           //the file's last line with a line now after
+   {                                         //it, it had no newline
+      len = sv->base_size - from;
+      nl = TRUE;
+   }
+
+   switch (sv->pass)
+   {
+      case _SV_CHECK:
+      {
+         sv->fits = ((sv->fits) && (from == sv->at));
+         sv->at += len;
+         break;
+      }
+
+      case _SV_PATCH:
+      {
+         flush_save_batch(sv, NULL);
+         sv->at += len;
+         break;
+      }
+
+      default:
+      {
+         flush_save_batch(sv, NULL);
+
+         if (sv->run_from + sv->run_len != from)
+            flush_save_run(sv);
+         if (sv->run_len == 0)
+            sv->run_from = from;
+         sv->run_len += len;
+
+         break;
+      }
+   } //switch
+
+   if (nl)
+      save_text(sv, NULL, TRUE);
+}
+
+
+void flush_save_batch(_save_batch *sv, _line *ln)
+{
+   //writes out the lines gathered so far, followed by the text of line ln
+   //straight from both sides of its gap, if there is one
+
+   struct iovec piece[3], *iov = piece;
+   int n = 1;
+
+   piece[0].iov_base = sv->stage;
+   piece[0].iov_len = sv->staged;
+
+   if (ln != NULL)
+   {
+      piece[1].iov_base = ln->txt;
+      piece[1].iov_len = ln->gap;
+      piece[2].iov_base = &ln->txt[ln->gap + ln->gap_len];
+      piece[2].iov_len = ln->len - ln->gap;
+      n = 3;
+   }
+
+   while ((n > 0) && (iov->iov_len == 0))     //nothing to write, nothing to do
+   {
+      iov++;
+      n--;
+   }
+
+   while ((n > 0) && (!sv->error))
+   {
+      long done = pwritev(sv->fd, iov, n, sv->at);
+
+      if (done <= 0)
+      {
+         sv->error = TRUE;
+         break;
+      }
+
+      sv->bytes += done;
+      sv->at += done;
+
+      while ((n > 0) && (done >= (long) iov->iov_len))   //skip what was written...
+      {
+         done -= iov->iov_len;
+         iov++;
+         n--;
+      }
+
+      if (n > 0)                                        //...and a piece cut short
+      {
+         iov->iov_base = (char*) iov->iov_base + done;
+         iov->iov_len -= done;
+      }
+   } //while
+
+   sv->staged = 0;
+}
+
+
+void flush_save_run(_save_batch *sv)
+{
+   //copies the run of unedited text gathered so far across from the file
+   //as loaded, in the kernel where it can be, or through the stage if not
+
+   loff_t from = sv->run_from, to = sv->at;
+   long done;
+
+   while ((sv->run_len > 0) && (!sv->error))
+   {
+      done = copy_file_range(sv->base, &from, sv->fd, &to, sv->run_len, 0);
+
+      if (done <= 0)                            //can't between these files, or at all
+      {
+         done = pread(sv->base, sv->stage, (sv->run_len < _SAVE_STAGE) ? sv->run_len : _SAVE_STAGE,
+                      from);
+         if ((done <= 0) || (pwrite(sv->fd, sv->stage, done, to) != done))
+         {
+            sv->error = TRUE;
+            break;
+         }
+         from += done;
+         to += done;
+      }
+
+      sv->run_len -= done;
+      sv->copied += done;
+      sv->at += done;
+   } //while
+
+   sv->run_len = 0;
+}
+
+
+void open_journal(_txt_buf *txt_buf, char *filename)
+{
+   //starts journaling the edits to the buffer; if the journal of an earlier
+   //session that never saved is still there, and is of the file as it is
+   //now, its edits are made over again first, as one step that can be undone
+
+   _journal *jn = malloc(sizeof(_journal));
+   char head[_JNL_HEAD];
+   unsigned char *old = NULL;
+   long size = 0, got = 1, edits = 0;
+   int fd;
+
+   jn->path = malloc(strlen(filename) + 8);
+   sprintf(jn->path, "%s.noir#", filename);
+   jn->filename = filename;
+   jn->batch = malloc(_JNL_BATCH);
+   jn->used = 0;
+   jn->saved_at = 0;
+   journal_head(head, filename);
+
+   if ((fd = open(jn->path, O_RDONLY)) != -1)   //read the old one in, all of it
+   {
+      struct stat st;
+
+      if ((fstat(fd, &st) == 0) && (st.st_size >= _JNL_HEAD))
+      {
+         old = malloc(st.st_size);
+         while ((size < st.st_size) && (got > 0))
+         {
+            got = read(fd, &old[size], st.st_size - size);
+            size += (got > 0) ? got : 0;
+         }
+      }
+      close(fd);
+   }
+
+   if ((old != NULL) && (size >= _JNL_HEAD) && (memcmp(old, head, _JNL_HEAD) == 0))
+   {
+      wait_for_lines(txt_buf, LONG_MAX);        //it edits the whole file
+      undo_step(txt_buf, FALSE);
+      edits = replay_journal(txt_buf, &old[_JNL_HEAD], size - _JNL_HEAD);
+      size = _JNL_HEAD + edits;                 //anything after the last whole edit goes
+      if (edits > 0)
+         sprintf(status_msg, "recovered unsaved edits, %ld bytes of journal", edits);
+   }
+   free(old);
+
+   if (edits > 0)                               //carry on with it
+      jn->fd = open(jn->path, O_RDWR);
+   else                                         //or start a new one
+   {
+      size = _JNL_HEAD;
+      if (((jn->fd = open(jn->path, O_RDWR | O_CREAT | O_TRUNC, 0600)) != -1) &&
+          (pwrite(jn->fd, head, _JNL_HEAD, 0) != _JNL_HEAD))
+      {
+         close(jn->fd);
+         jn->fd = -1;
+      }
+   }
+
+   if ((jn->fd != -1) && (ftruncate(jn->fd, size) == 0))
+      jn->size = size;
+   else                                         //can't journal, no harm done
+   {
+      if (jn->fd != -1)
+         close(jn->fd);
+      free(jn->batch);
+      free(jn->path);
+      free(jn);
+      jn = NULL;
+   }
+
+   txt_buf->journal = jn;
+}
+
+
+long replay_journal(_txt_buf *txt_buf, unsigned char *rec, long size)
+{
+   //makes the journaled edits over again, without journaling them; stops at
+   //an edit cut short or one that doesn't fit the buffer, as after a crash
+   //halfway through writing it. returns the bytes of edits made
+
+   long i = 0, done = 0, arg[4];
+   int j, k, shift, op;
+
+   while (i < size)
+   {
+      op = rec[i++];
+      k = journal_arity(op);
+
+      for (j = 0; j < k; j++)                   //lines and offsets, 7 bits a byte
+      {
+         for (arg[j] = 0, shift = 0; (i < size) && (rec[i] & 0x80) && (shift < 56); shift += 7)
+            arg[j] |= (long) (rec[i++] & 0x7f) << shift;
+         if (i >= size)
+            return(done);
+         arg[j] |= (long) rec[i++] << shift;
+      }
+
+      if ((op == _JN_ADD) && (i >= size))
+         return(done);
+
+      if ((arg[0] >= num_lines(txt_buf)) && ((op != _JN_BLANK) || (arg[0] > INT_MAX)))
+         return(done);
+
+      switch (op)
+      {
+         case _JN_ADD:
+         {
+            if (arg[1] > INT_MAX - 1)
+               return(done);
+            buf_add_char(txt_buf, arg[0], arg[1], rec[i++]);
+            break;
+         }
+
+         case _JN_DEL:
+         {
+            if ((arg[1] < 1) || (arg[1] > get_line(txt_buf, arg[0])->len))
+               return(done);
+            buf_del_char(txt_buf, arg[0], arg[1]);
+            break;
+         }
+
+         case _JN_SPLIT:
+         {
+            buf_split_line(txt_buf, arg[0], (arg[1] < INT_MAX) ? arg[1] : INT_MAX);
+            break;
+         }
+
+         case _JN_JOIN:
+         {
+            if (arg[0] + 1 >= num_lines(txt_buf))
+               return(done);
+            buf_join_lines(txt_buf, arg[0]);
+            break;
+         }
+
+         case _JN_BLANK:
+         {
+            init_blank_lines(txt_buf, arg[0]);
+            break;
+         }
+
+         case _JN_TEXT:
+         {
+            if ((arg[1] > INT_MAX - 1) || (arg[2] > size - i))
+               return(done);
+            buf_insert_text(txt_buf, arg[0], arg[1], (char*) &rec[i], arg[2]);
+            i += arg[2];
+            break;
+         }
+
+         case _JN_RANGE:
+         {
+            if ((arg[2] < arg[0]) || (arg[2] >= num_lines(txt_buf)) ||
+                (arg[1] > get_line(txt_buf, arg[0])->len) ||
+                (arg[3] > get_line(txt_buf, arg[2])->len) ||
+                ((arg[2] == arg[0]) && (arg[3] < arg[1])))
+               return(done);
+            buf_delete_range(txt_buf, arg[0], arg[1], arg[2], arg[3]);
+            break;
+         }
+
+         default:
+            return(done);
+      } //switch
+
+      done = i;
+   } //while
+
+   return(done);
+}
+
+
+void journal_head(char *head, char *filename)
+{
+   //makes the journal header, naming the version of the file the edits
+   //are to: its size, inode and the time it was changed, or -1 if it
+   //doesn't exist
+
+   struct stat st;
+   long id[4] = {-1, 0, 0, 0};
+
+   if (stat(filename, &st) == 0)
+   {
+      id[0] = st.st_size;
+      id[1] = st.st_ino;
+      id[2] = st.st_mtim.tv_sec;
+      id[3] = st.st_mtim.tv_nsec;
+   }
+
+   memcpy(head, _JNL_MAGIC, 8);
+   memcpy(&head[8], id, sizeof(id));
+}
+
+
+void journal_edit(_txt_buf *txt_buf, int op, long n, long offset, int ch)
+{
+   //notes an edit in the journal; edits are gathered and written out in
+   //batches, once input goes idle or the batch fills up
+
+   long arg[2] = {n, offset};
+   char *p = journal_args(txt_buf->journal, op, arg, journal_arity(op));
+
+   if ((p != NULL) && (op == _JN_ADD))
+      *p++ = ch;
+
+   if (p != NULL)
+      txt_buf->journal->used = p - txt_buf->journal->batch;
+}
+
+
+void journal_text(_txt_buf *txt_buf, long n, long offset, char *txt, long len)
+{
+   //notes text put in at offset in line n, newlines and all
+
+   _journal *jn = txt_buf->journal;
+   long arg[3] = {n, offset, len}, k;
+   char *p = journal_args(jn, _JN_TEXT, arg, 3);
+
+   if (p == NULL)
+      return;
+
+   for (jn->used = p - jn->batch; len > 0; len -= k, txt += k)
+   {
+      if (jn->used == _JNL_BATCH)
+         flush_journal(jn);
+
+      k = (len < _JNL_BATCH - jn->used) ? len : _JNL_BATCH - jn->used;
+      memcpy(&jn->batch[jn->used], txt, k);
+      jn->used += k;
+   }
+}
+
+
+void journal_range(_txt_buf *txt_buf, long n, long offset, long n2, long offset2)
+{
+   //notes the text from offset in line n to offset2 in line n2 taken out
+
+   long arg[4] = {n, offset, n2, offset2};
+   char *p = journal_args(txt_buf->journal, _JN_RANGE, arg, 4);
+
+   if (p != NULL)
+      txt_buf->journal->used = p - txt_buf->journal->batch;
+}
+
+
+int journal_arity(int op)
+{
+   //returns the number of line and offset arguments an edit takes
+
+   if ((op == _JN_JOIN) || (op == _JN_BLANK))
+      return(1);
+   if (op == _JN_TEXT)
+      return(3);                             //and the length of the text after it
+
+   return((op == _JN_RANGE) ? 4 : 2);
+}
+
+
+char *journal_args(_journal *jn, int op, long *arg, int k)
+{
+   //starts an edit in the journal batch: the op, then its arguments at
+   //7 bits a byte; returns where what follows goes, or NULL if there's
+   //no journal
+
+   unsigned char *p;
+   int j;
+
+   if (jn == NULL)
+      return(NULL);
+
+   if (jn->used > _JNL_BATCH - 64)
+      flush_journal(jn);
+   if (jn->used == 0)                        //write it out when there's time
+      bg_event = TRUE;
+
+   p = (unsigned char*) &jn->batch[jn->used];
+   *p++ = op;
+
+   for (j = 0; j < k; j++)
+   {
+      for (; arg[j] > 0x7f; arg[j] >>= 7)
+         *p++ = (arg[j] & 0x7f) | 0x80;
+      *p++ = arg[j];
+   }
+
+   return((char*) p);
+}
+
+
+void flush_journal(_journal *jn)
+{
+   //writes out the edits gathered so far; if they can't be written the
+   //journal is no longer of use and goes
+
+   long done = 0, n;
+
+   while ((jn->fd != -1) && (done < jn->used))
+   {
+      if ((n = pwrite(jn->fd, &jn->batch[done], jn->used - done, jn->size + done)) <= 0)
+      {
+         close(jn->fd);
+         unlink(jn->path);
+         jn->fd = -1;
+         strcpy(status_msg, "error writing journal, edits not journaled.");
+      }
+      done += (n > 0) ? n : 0;
+   }
+
+   jn->size += done;
+   jn->used = 0;
+}
+
+
+void restart_journal(_txt_buf *txt_buf, char *filename)
+{
+   //starts the journal over once the file is saved, with just the edits
+   //made since the snapshot that was saved, written next to it and renamed
+   //over it so a crash leaves one journal or the other
+
+   _journal *jn = txt_buf->journal;
+   char *path, *keep;
+   long n;
+   int fd;
+
+   if ((jn == NULL) || (jn->fd == -1) || (strcmp(filename, jn->filename)))
+      return;
+
+   flush_journal(jn);
+   n = _JNL_HEAD + jn->size - jn->saved_at;
+   keep = malloc(n);
+   journal_head(keep, filename);
+   path = malloc(strlen(jn->path) + 2);
+   sprintf(path, "%s~", jn->path);
+
+   if ((pread(jn->fd, &keep[_JNL_HEAD], n - _JNL_HEAD, jn->saved_at) == n - _JNL_HEAD) &&
+       ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) != -1))
+   {
+      if ((write(fd, keep, n) == n) && (rename(path, jn->path) == 0))
+      {
+         close(jn->fd);
+         jn->fd = fd;
+         jn->size = n;
+      }
+      else
+      {
+         close(fd);
+         unlink(path);
+      }
+   }
+
+   jn->saved_at = jn->size;
+   free(path);
+   free(keep);
+}
+
+
+void close_journal(_txt_buf *txt_buf)
+{
+   //done editing, the journal goes
+
+   _journal *jn = txt_buf->journal;
+
+   if (jn == NULL)
+      return;
+
+   if (jn->fd != -1)
+      close(jn->fd);
+   unlink(jn->path);
+
+   free(jn->batch);
+   free(jn->path);
+   free(jn);
+   txt_buf->journal = NULL;
+}
+
+
+_undo *init_undo()
+{
+   //initializes an empty undo history
+
+   _undo *u = malloc(sizeof(_undo));
+
+   u->first = NULL;
+   u->last = NULL;
+   u->top = NULL;
+   u->bytes = 0;
+   u->steps = 0;
+   u->step = 0;
+   u->typing = FALSE;
+   u->floor = 0;
+   u->applying = FALSE;
+
+   return(u);
+}
+
+
+void undo_step(_txt_buf *txt_buf, int typing)
+{
+   //starts the edits made for the next key, all undone together; the edits
+   //of a run of typing keys are undone together too
+
+   _undo *u = txt_buf->undo;
+
+   if (u == NULL)
+      return;
+
+   u->step = ++u->steps;
+   u->typing = typing;
+}
+
+
+void note_undo(_txt_buf *txt_buf, int kind, long n, int offset, char *txt, long len)
+{
+   //notes text put in (_UN_INS) or backspaced out (_UN_BKS) at offset in line n,
+   //before it happens; text put in past the end of line is padded with spaces.
+   //it goes onto the last record when it carries on from where that left off
+
+   _undo *u = txt_buf->undo;
+   _undo_rec *rec;
+   long n2, pad = 0, i;
+   int offset2, len_n;
+
+   if ((u == NULL) || (u->applying))
+      return;
+
+   len_n = get_line(txt_buf, n)->len;
+   if (offset > len_n)
+   {
+      pad = offset - len_n;
+      offset = len_n;
+   }
+   text_end(n, offset + pad, txt, len, &n2, &offset2);
+
+   rec = u->top;
+   if ((rec != NULL) && (rec->kind == kind) && (next_undo_rec(u, rec) == NULL) &&
+       ((rec->step == u->step) || ((rec->typing) && (u->typing))) &&
+       (((kind == _UN_INS) && (rec->n2 == n) && (rec->offset2 == offset)) ||
+        ((kind == _UN_BKS) && (rec->n == n2) && (rec->offset == offset2))))
+   {
+      rec = grow_undo_rec(u, pad + len);             //carries on from the last one
+      u->step = rec->step;
+   }
+   else
+   {
+      rec = add_undo_rec(u, pad + len);
+      rec->kind = kind;
+      rec->n = n;
+      rec->offset = offset;
+      rec->n2 = n2;
+      rec->offset2 = offset2;
+   }
+
+   if (kind == _UN_INS)                              //text runs on at the end...
+   {
+      memset(&rec->txt[rec->len], 32, pad);
+      memcpy(&rec->txt[rec->len + pad], txt, len);
+      rec->n2 = n2;
+      rec->offset2 = offset2;
+   }
+   else                                              //...or backwards from the start
+   {
+      for (i = 0; i < len; i++)
+         rec->txt[rec->len + i] = txt[len - 1 - i];
+      rec->n = n;
+      rec->offset = offset;
+   }
+
+   rec->len += pad + len;
+}
+
+
+void note_undo_range(_txt_buf *txt_buf, long n, int offset, long n2, int offset2)
+{
+   //notes the text from offset in line n to offset2 in line n2 being taken
+   //out, copying it out of the buffer into a record of its own
+
+   _undo *u = txt_buf->undo;
+   _undo_rec *rec;
+   long len;
+
+   if ((u == NULL) || (u->applying))
+      return;
+
+   len = (n == n2) ? offset2 - offset
+                   : line_offset(txt_buf, n2) + offset2 - line_offset(txt_buf, n) - offset;
+
+   rec = add_undo_rec(u, len);
+   rec->kind = _UN_DEL;
+   rec->n = n;
+   rec->offset = offset;
+   rec->n2 = n2;
+   rec->offset2 = offset2;
+   rec->len = len;
+
+   copy_range_text(txt_buf, n, offset, n2, offset2, rec->txt);
+}
+
+
+_undo_rec *add_undo_rec(_undo *u, long len)
+{
+   //starts a new record with room for len bytes of text after the last edit
+   //not undone; what was undone before it can't be redone any more, and the
+   //oldest history goes once there's more of it than allowed
+
+   _undo_chunk *c;
+   _undo_rec *rec;
+   long size = (sizeof(_undo_rec) + len + 7) & ~7L;
+
+   forget_undo(u);                               //can't redo after an edit
+
+   c = u->last;
+   if ((c == NULL) || (c->size - c->used < size))
+      c = add_undo_chunk(u, size);
+
+   rec = (_undo_rec*) &c->mem[c->used];
+   c->used += size;
+
+   rec->prev = u->top;
+   rec->chunk = c;
+   rec->size = size;
+   rec->step = u->step;
+   rec->typing = u->typing;
+   rec->len = 0;
+   u->top = rec;
+
+   trim_undo(u);
+
+   return(rec);
+}
+
+
+_undo_rec *grow_undo_rec(_undo *u, long len)
+{
+   //makes room for len more bytes of text in the last record, moving it to
+   //a chunk of its own twice as large as it needs if its chunk is full
+
+   _undo_rec *rec = u->top, *moved;
+   _undo_chunk *c = rec->chunk;
+   long size = (sizeof(_undo_rec) + rec->len + len + 7) & ~7L;
+
+   if ((char*) rec + size > &c->mem[c->size])         //no room where it is
+   {
+      moved = (_undo_rec*) add_undo_chunk(u, 2 * size)->mem;
+      memcpy(moved, rec, sizeof(_undo_rec) + rec->len);
+      moved->chunk = u->last;
+      moved->chunk->used = moved->size;
+      u->top = rec = moved;
+
+      c->used -= rec->size;
+      if (c->used == 0)                                 //nothing else left in it
+      {
+         if (c->prev != NULL)
+            c->prev->next = c->next;
+         else
+            u->first = c->next;
+         c->next->prev = c->prev;
+         u->bytes -= c->size;
+         free(c);
+      }
+   }
+
+   rec->chunk->used += size - rec->size;
+   rec->size = size;
+   trim_undo(u);
+
+   return(rec);
+}
+
+
+_undo_chunk *add_undo_chunk(_undo *u, long size)
+{
+   //adds a chunk to the end of the arena, of at least size bytes
+
+   _undo_chunk *c;
+
+   size = (size > _UNDO_CHUNK) ? size : _UNDO_CHUNK;
+   c = malloc(sizeof(_undo_chunk) + size);
+   c->prev = u->last;
+   c->next = NULL;
+   c->size = size;
+   c->used = 0;
+
+   if (u->last != NULL)
+      u->last->next = c;
+   else
+      u->first = c;
+   u->last = c;
+   u->bytes += size;
+
+   return(c);
+}
+
+
+void trim_undo(_undo *u)
+{
+   //lets the oldest history go while there's more of it than allowed; a
+   //key's edits cut in two that way can't be undone any more
+
+   _undo_chunk *c;
+   _undo_rec *rec;
+
+   while ((u->bytes > undo_cap) && (u->first != u->last) && (u->first != u->top->chunk))
+   {
+      c = u->first;
+      for (rec = (_undo_rec*) c->mem; (char*) rec < &c->mem[c->used];
+           rec = (_undo_rec*) ((char*) rec + rec->size))
+         u->floor = rec->step;
+
+      u->first = c->next;
+      u->first->prev = NULL;
+      u->bytes -= c->size;
+      free(c);
+
+      if (u->first->used > 0)
+         ((_undo_rec*) u->first->mem)->prev = NULL;
+   }
+}
+
+
+_undo_rec *next_undo_rec(_undo *u, _undo_rec *rec)
+{
+   //returns the record after rec in the arena, the first one if rec is
+   //NULL, or NULL if there's none
+
+   _undo_chunk *c = (rec != NULL) ? rec->chunk : u->first;
+   char *p = (rec != NULL) ? (char*) rec + rec->size : NULL;
+
+   if ((c != NULL) && (p != NULL) && (p < &c->mem[c->used]))
+      return((_undo_rec*) p);
+
+   c = (rec != NULL) ? c->next : c;
+
+   return(((c != NULL) && (c->used > 0)) ? (_undo_rec*) &c->mem[0] : NULL);
+}
+
+
+void forget_undo(_undo *u)
+{
+   //forgets the records after the last edit not undone
+
+   _undo_chunk *c = (u->top != NULL) ? u->top->chunk : u->first, *next;
+
+   if (c == NULL)
+      return;
+
+   c->used = (u->top != NULL) ? (char*) u->top + u->top->size - c->mem : 0;
+
+   for (next = c->next; next != NULL; next = c)
+   {
+      c = next->next;
+      u->bytes -= next->size;
+      free(next);
+   }
+
+   c = (u->top != NULL) ? u->top->chunk : u->first;
+   c->next = NULL;
+   u->last = c;
+}
+
+
+void text_end(long n, int offset, char *txt, long len, long *n2, int *offset2)
+{
+   //finds where text put in at offset in line n ends
+
+   char *nl = txt, *last = NULL;
+   long lines = 0;
+
+   while ((nl = memchr(nl, '\n', &txt[len] - nl)) != NULL)
+   {
+      last = nl++;
+      lines++;
+   }
+
+   *n2 = n + lines;
+   *offset2 = (last == NULL) ? offset + len : &txt[len] - last - 1;
+}
+
+
+int undo_edits(_txt_buf *txt_buf, int redo, long *n, int *offset)
+{
+   //undoes (or redoes) the edits made for the last key not undone (or the
+   //first one undone), each in one go however large; returns FALSE if there
+   //are none, else where they were
+
+   _undo *u = txt_buf->undo;
+   _undo_rec *rec = (u != NULL) ? ((redo) ? next_undo_rec(u, u->top) : u->top) : NULL;
+   long step;
+   char *txt;
+   long i;
+
+   if ((rec == NULL) || (rec->step <= u->floor))
+      return(FALSE);
+
+   step = rec->step;
+   u->applying = TRUE;
+
+   while ((rec != NULL) && (rec->step == step))
+   {
+      *n = rec->n;
+      *offset = rec->offset;
+
+      if ((rec->kind == _UN_INS) == (redo))            //put the text back in
+      {
+         txt = rec->txt;
+         if (rec->kind == _UN_BKS)
+         {
+            txt = malloc(rec->len);
+            for (i = 0; i < rec->len; i++)
+               txt[i] = rec->txt[rec->len - 1 - i];
+         }
+
+         buf_insert_text(txt_buf, rec->n, rec->offset, txt, rec->len);
+
+         if (txt != rec->txt)
+            free(txt);
+      }
+      else                                              //or take it out again
+         buf_delete_range(txt_buf, rec->n, rec->offset, rec->n2, rec->offset2);
+
+      u->top = (redo) ? rec : rec->prev;
+      rec = (redo) ? next_undo_rec(u, rec) : rec->prev;
+   } //while
+
+   u->applying = FALSE;
+
+   return(TRUE);
+}
+
+
+int find_in_buf(_txt_buf *txt_buf, _finder *fd, long *n, int *offset)
+{
+   //finds the text after offset in line n, or before it looking backwards,
+   //going round the end of the buffer to the other side if it has to; a
+   //block of lines at a time. returns _FD_ how it went, n and offset are
+   //set to where the text was found
+
+   long i = *n, from = (fd->back) ? *offset - 1 : *offset + 1;
+   int k, at, hit, wrapped = FALSE;
+   _line_blk *blk;
+   char *key = (fd->re != NULL) ? fd->re->find.re->lit : fd->txt;   //all there is to it, or
+   int key_len = (fd->re != NULL) ? fd->re->find.re->lit_len : fd->len;   //what a match starts with
+
+   fd->scanned = 0;
+   fd->next_check = _FIND_SLICE;
+   fd->start = get_time();
+
+   if (fd->back)                                        //the far end is where it goes round
+   {
+      wait_for_lines(txt_buf, LONG_MAX);
+      if (i >= num_lines(txt_buf))
+      {
+         i = num_lines(txt_buf) - 1;
+         from = LONG_MAX;
+      }
+   }
+
+   while (TRUE)
+   {
+      if ((i >= num_lines(txt_buf)) && (txt_buf->loading != NULL))
+         wait_for_lines(txt_buf, i);                    //it may just not be loaded yet
+
+      if ((blk = find_buf_line(txt_buf, i, &k)) == NULL)
+      {
+         if (wrapped)                                   //been everywhere
+            return(_FD_NONE);
+
+         wrapped = TRUE;                                //the other end
+         i = (fd->back) ? num_lines(txt_buf) - 1 : 0;
+         from = (fd->back) ? LONG_MAX : 0;
+         continue;
+      }
+
+      if ((may_hold_text(blk, key, key_len)) && ((hit = find_in_line_blk(txt_buf, fd, blk, k, from, &at)) >= 0))
+      {
+         *n = i - k + hit;
+         *offset = at;
+         return((wrapped) ? _FD_WRAPPED : _FD_FOUND);
+      }
+
+      if ((wrapped) && ((fd->back) ? (i - k <= *n) : (i - k + blk->count > *n)))
+         return(_FD_NONE);                              //back where it started
+      if (!find_going(fd))
+         return(_FD_STOPPED);
+
+      i = (fd->back) ? i - k - 1 : i - k + blk->count;
+      from = (fd->back) ? LONG_MAX : 0;
+   } //while
+}
+
+
+int find_in_line_blk(_txt_buf *txt_buf, _finder *fd, _line_blk *blk, int k, long from, int *at)
+{
+   //finds the text in the block from offset from in line k on, or before
+   //that looking backwards. returns the line it's in, -1 if none, and sets
+   //at to where in the line. a whole block still as it is in a file kept
+   //mapped is searched in one go, newlines and all; a regex goes by line
+
+   _line *ln;
+   long hit, lo, hi, size;
+   int i;
+
+   if ((txt_buf->file != NULL) && (blk->orig >= 0) && (fd->re == NULL) &&
+       ((fd->back) ? ((k == blk->count - 1) && (from == LONG_MAX)) : ((k == 0) && (from == 0))))
+   {
+      size = blk->bytes;                                //the last newline may be missing
+      if (blk->orig + size > txt_buf->file_size)
+         size = txt_buf->file_size - blk->orig;
+
+      fd->scanned += size;
+      hit = (fd->back) ? scan_find_last(&txt_buf->file[blk->orig], size, fd->txt, fd->len)
+                       : scan_find(&txt_buf->file[blk->orig], size, fd->txt, fd->len);
+      if (hit < 0)
+         return(-1);
+
+      for (i = 0; hit > blk->line[i].len; i++)          //which line is it in
+         hit -= blk->line[i].len + 1;
+
+      *at = hit;
+      return(i);
+   }
+
+   for (i = k; (i >= 0) && (i < blk->count); i += (fd->back) ? -1 : 1)
+   {
+      ln = &blk->line[i];
+      __builtin_prefetch(blk->line[(fd->back) ? ((i > 1) ? i - 2 : 0) : ((i + 2 < blk->count) ? i + 2 : i)].txt);
+      lo = ((!fd->back) && (i == k)) ? from : 0;
+      hi = ((fd->back) && (i == k) && (from < ln->len - fd->len)) ? from + fd->len : ln->len;
+      hit = -1;
+
+      if (fd->re != NULL)
+         hit = find_regex(fd, ln, (fd->back) ? ((i == k) ? from : LONG_MAX) : lo);
+      else if (lo < hi)
+      {
+         char *txt = flat_line_text(fd, ln);
+
+         hit = (fd->back) ? scan_find_last(txt, hi, fd->txt, fd->len)
+                          : scan_find(&txt[lo], hi - lo, fd->txt, fd->len);
+         hit += (hit >= 0) ? lo : 0;
+      }
+
+      fd->scanned += ln->len + 1;
+      if (hit >= 0)
+      {
+         *at = hit;
+         return(i);
+      }
+   } //for
+
+   return(-1);
+}
+
+
+char *flat_line_text(_finder *fd, _line *ln)
+{
+   //returns the text of the line in one piece, as it's shown; only a line
+   //with its gap somewhere in the middle, or one in the file that may have
+   //needed sanitizing (it's only clean for sure while orig is kept), needs
+   //to be copied out
+
+   if ((ln->shared == _SHARE_FILE) ? (ln->orig >= 0) : (ln->gap >= ln->len))
+      return(ln->txt);
+   if ((ln->shared != _SHARE_FILE) && (ln->gap == 0))
+      return(&ln->txt[ln->gap_len]);
+
+   if (fd->flat_size < ln->len)
+   {
+      fd->flat_size = 2 * ln->len;
+      fd->flat = realloc(fd->flat, fd->flat_size);
+   }
+
+   copy_line_text(ln, 0, ln->len, fd->flat);
+
+   return(fd->flat);
+}
+
+
+int find_going(_finder *fd)
+{
+   //every so often shows how far a long search has got, and checks for a
+   //key to stop it; returns FALSE if it's to stop
+
+   double t;
+
+   if (fd->scanned < fd->next_check)
+      return(TRUE);
+
+   fd->next_check = fd->scanned + _FIND_SLICE;
+   t = get_time() - fd->start;
+
+   if ((fd->cursor == NULL) || (t < _FIND_QUIET))
+      return(TRUE);
+
+   sprintf(status_msg, "finding... %.1f MB, %.1f MB/s, any key stops", fd->scanned / 1e6,
+           fd->scanned / 1e6 / t);
+   show_status(fd->cursor);
+
+   return(poll_input() == ERR);
+}
+
+
+void index_line_blk(_line_blk *blk)
+{
+   //indexes the trigrams of a block of lines, or takes them from the index
+   //saved for the file if the block is there as it is
+
+   long lo = 0, hi = tri_saved_count, mid;
+   char *at;
+   int i;
+
+   if (blk->tri == NULL)
+      blk->tri = malloc(_TRI_SIZE);
+
+   while ((blk->orig >= 0) && (lo < hi))               //saved in file order
+   {
+      mid = (lo + hi) / 2;
+      at = &tri_saved[_TRI_HEAD + mid * (2 * sizeof(long) + _TRI_SIZE)];
+
+      if (((long*) at)[0] < blk->orig)
+         lo = mid + 1;
+      else if (((long*) at)[0] > blk->orig)
+         hi = mid;
+      else
+      {
+         if (((long*) at)[1] != blk->bytes)
+            break;
+
+         memcpy(blk->tri, &at[2 * sizeof(long)], _TRI_SIZE);
+         blk->tri_dirty = 0;
+         return;
+      }
+   } //while
+
+   memset(blk->tri, 0, _TRI_SIZE);
+   for (i = 0; i < blk->count; i++)
+      add_trigrams(blk->tri, &blk->line[i]);
+   blk->tri_dirty = 0;
+}
+
+
+void add_trigrams(unsigned char *tri, _line *ln)
+{
+   //adds the trigrams of the line to the set of them, each hashed to a bit;
+   //only a line with its gap somewhere in the middle, or one in the file
+   //that may have needed sanitizing, needs copying out first
+
+   unsigned char *txt = (unsigned char*) ln->txt, *flat = NULL;
+   unsigned int h;
+   int i;
+
+   if (ln->len < 3)
+      return;
+
+   if ((ln->shared != _SHARE_FILE) && (ln->gap == 0))
+      txt = &txt[ln->gap_len];
+   else if ((ln->shared == _SHARE_FILE) ? (ln->orig < 0) : (ln->gap < ln->len))
+   {
+      txt = flat = malloc(ln->len);
+      copy_line_text(ln, 0, ln->len, (char*) flat);
+   }
+
+   for (i = 0; i + 2 < ln->len; i++)
+   {
+      h = ((txt[i] | (txt[i + 1] << 8) | (txt[i + 2] << 16)) * 2654435761u) >> 20;
+      if (!((tri[h >> 3] >> (h & 7)) & 1))          //mostly there already, no store then
+         tri[h >> 3] |= 1 << (h & 7);
+   }
+
+   free(flat);
+}
+
+
+int may_hold_text(_line_blk *blk, char *txt, int len)
+{
+   //returns FALSE if the block can't have the text in any of its lines, all
+   //of the text's trigrams not being there; lines edited since the block
+   //was indexed are added in first
+
+   unsigned int t, h;
+   int i;
+
+   if ((blk->tri == NULL) || (len < 3))
+      return(TRUE);
+
+   for (i = 0; (blk->tri_dirty != 0) && (i < _BLK_LINES); i++)
+      if ((blk->tri_dirty >> i) & 1)
+      {
+         if (i < blk->count)
+            add_trigrams(blk->tri, &blk->line[i]);
+         blk->tri_dirty &= ~(1ULL << i);
+      }
+
+   for (i = 0; i + 2 < len; i++)
+   {
+      t = (unsigned char) txt[i] | ((unsigned char) txt[i + 1] << 8) | ((unsigned char) txt[i + 2] << 16);
+      h = (t * 2654435761u) >> 20;
+      if (!((blk->tri[h >> 3] >> (h & 7)) & 1))
+         return(FALSE);
+   }
+
+   return(TRUE);
+}
+
+
+void open_trigrams(char *filename, struct stat *st)
+{
+   //maps the trigram index saved next to the file ("filename.noir3") if it's
+   //for the file as it is now, else starts a new one to be renamed over it
+   //once all the file is indexed
+
+   long head[_TRI_HEAD / sizeof(long)];
+   int fd;
+
+   tri_path = malloc(strlen(filename) + 8);
+   sprintf(tri_path, "%s.noir3", filename);
+
+   if ((fd = open(tri_path, O_RDONLY)) != -1)
+   {
+      struct stat ist;
+
+      if ((read(fd, head, _TRI_HEAD) == _TRI_HEAD) && (head[0] == _TRI_MAGIC) &&
+          (head[1] == st->st_size) && (head[2] == st->st_mtim.tv_sec) &&
+          (head[3] == st->st_mtim.tv_nsec) && (head[4] == _TRI_SIZE) && (fstat(fd, &ist) == 0))
+      {
+         tri_saved_size = ist.st_size;
+         tri_saved = mmap(NULL, tri_saved_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         tri_saved_count = (tri_saved_size - _TRI_HEAD) / (2 * sizeof(long) + _TRI_SIZE);
+         if (tri_saved == MAP_FAILED)
+         {
+            tri_saved = NULL;
+            tri_saved_count = 0;
+         }
+      }
+      close(fd);
+   }
+
+   if (tri_saved != NULL)
+      return;
+
+   sprintf(tri_path, "%s.noir3~", filename);   //no more readable than the file, it tells of its text
+   if ((tri_out = open(tri_path, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 0666)) == -1)
+      return;
+   fchmod(tri_out, st->st_mode & 0666);         //one left over keeps its own otherwise
+
+   head[0] = _TRI_MAGIC;
+   head[1] = st->st_size;
+   head[2] = st->st_mtim.tv_sec;
+   head[3] = st->st_mtim.tv_nsec;
+   head[4] = _TRI_SIZE;
+   if (write(tri_out, head, _TRI_HEAD) != _TRI_HEAD)
+   {
+      close(tri_out);
+      tri_out = -1;
+   }
+}
+
+
+void save_trigrams(_line_blk *blk)
+{
+   //writes the trigrams of the blocks of a tree just loaded to the new
+   //index, in file order; the loading threads are done with them
+
+   char *at;
+
+   if ((blk == NULL) || (tri_out == -1))
+      return;
+
+   save_trigrams(blk->lf);
+
+   if ((blk->orig >= 0) && (blk->tri != NULL))
+   {
+      at = malloc(2 * sizeof(long) + _TRI_SIZE);
+      ((long*) at)[0] = blk->orig;
+      ((long*) at)[1] = blk->bytes;
+      memcpy(&at[2 * sizeof(long)], blk->tri, _TRI_SIZE);
+
+      if (write(tri_out, at, 2 * sizeof(long) + _TRI_SIZE) == 2 * sizeof(long) + _TRI_SIZE)
+         tri_new++;
+      else
+      {
+         close(tri_out);
+         unlink(tri_path);
+         tri_out = -1;
+      }
+      free(at);
+   }
+
+   save_trigrams(blk->rt);
+}
+
+
+void close_trigrams(_txt_buf *txt_buf)
+{
+   //once the file is loaded, puts the new index in place of the old one, or
+   //lets go of the old one; the size of the index joins the status message
+
+   char *path, *how = "";
+   long blks = count_trigrams(txt_buf->root);
+
+   if (tri_out != -1)
+   {
+      path = strdup(tri_path);
+      path[strlen(path) - 1] = '\0';                   //the ~ off
+
+      close(tri_out);
+      if ((tri_new > 0) && (rename(tri_path, path) == 0))
+         how = " saved";
+      else
+         unlink(tri_path);
+      tri_out = -1;
+      free(path);
+   }
+   else if (tri_saved != NULL)
+   {
+      munmap(tri_saved, tri_saved_size);
+      how = " read";
+   }
+
+   sprintf(&status_msg[strlen(status_msg)], ", index %.1f MB%s", blks * (_TRI_SIZE + 16.0) / 1e6, how);
+
+   tri_saved = NULL;
+   tri_saved_count = 0;
+   free(tri_path);
+   tri_path = NULL;
+}
+
+
+long count_trigrams(_line_blk *blk)
+{
+   //returns how many blocks of the tree are indexed
+
+   if (blk == NULL)
+      return(0);
+
+   return((blk->tri != NULL) + count_trigrams(blk->lf) + count_trigrams(blk->rt));
+}
+
+
+long replace_in_buf(_txt_buf *txt_buf, char *txt, char *with, long *lines, int *threads)
+{
+   //replaces txt with with all through the buffer. the blocks of lines are
+   //shared out between threads, each rebuilding the lines txt is in with
+   //all of it replaced at once; then the rebuilt lines are swapped in, in
+   //order. returns the replacements made, lines is set to the lines changed
+
+   int i, n;
+   long count, j, found = 0;
+   _line_blk **blks;
+   long *starts;
+   _replace_job *jobs;
+
+   *lines = 0;
+   if ((*threads = n = share_line_blks(txt_buf, &blks, &starts, &count)) == 0)
+      return(0);
+
+   jobs = calloc(n, sizeof(_replace_job));
+
+   for (i = 0; i < n; i++)
+   {
+      jobs[i].txt_buf = txt_buf;
+      jobs[i].blks = blks;
+      jobs[i].starts = starts;
+      jobs[i].first = (count / n) * i;
+      jobs[i].last = (i == n - 1) ? count : (count / n) * (i + 1);
+      jobs[i].fd.txt = txt;
+      jobs[i].fd.len = strlen(txt);
+      jobs[i].with = with;
+      jobs[i].with_len = strlen(with);
+   }
+   run_jobs(jobs, n, sizeof(_replace_job), replace_job);
+
+   for (i = 0; i < n; i++)                   //swap the rebuilt lines in
+   {
+      for (j = 0; j < jobs[i].count; j++)
+         buf_replace_line(txt_buf, jobs[i].lines[j].n, jobs[i].lines[j].txt, jobs[i].lines[j].len);
+
+      found += jobs[i].found;
+      *lines += jobs[i].count;
+
+      free(jobs[i].lines);
+      free(jobs[i].at);
+      free(jobs[i].fd.flat);
+   }
+
+   free(jobs);
+   free(starts);
+   free(blks);
+
+   return(found);
+}
+
+
+int share_line_blks(_txt_buf *txt_buf, _line_blk ***blks, long **starts, long *count)
+{
+   //lists the blocks of lines of the whole buffer in order, with the line
+   //each starts at, for sharing them out between threads; returns how many
+   //threads to share them between, 0 if there are no lines
+
+   int n = (load_threads > 0) ? load_threads : sysconf(_SC_NPROCESSORS_ONLN);
+   long at = 0;
+
+   wait_for_lines(txt_buf, LONG_MAX);
+
+   if ((*count = list_line_blks(txt_buf->root, NULL, NULL, 0, &at)) == 0)
+      return(0);
+
+   *blks = malloc(*count * sizeof(_line_blk*));
+   *starts = malloc(*count * sizeof(long));
+   at = 0;
+   list_line_blks(txt_buf->root, *blks, *starts, 0, &at);
+
+   n = (n < 1) ? 1 : n;
+   n = (txt_buf->root->n_bytes / n < _LOAD_SHARE) ? (txt_buf->root->n_bytes / _LOAD_SHARE) + 1 : n;
+   n = (n > *count) ? *count : n;
+
+   return(n);
+}
+
+
+long list_line_blks(_line_blk *blk, _line_blk **blks, long *starts, long k, long *n)
+{
+   //lists the blocks of the subtree in order from blks[k] on, with the line
+   //each starts at counting on from n; with no list they're only counted.
+   //returns k moved on past them
+
+   if (blk == NULL)
+      return(k);
+
+   k = list_line_blks(blk->lf, blks, starts, k, n);
+
+   if (blks != NULL)
+   {
+      blks[k] = blk;
+      starts[k] = *n;
+   }
+   *n += blk->count;
+
+   return(list_line_blks(blk->rt, blks, starts, k + 1, n));
+}
+
+
+void *replace_job(void *job)
+{
+   //rebuilds the lines of a share of the blocks that the text is in; a
+   //block still as it is in a file kept mapped is looked through in one go
+   //first, and passed over if it isn't there
+
+   _replace_job *jb = job;
+   _txt_buf *txt_buf = jb->txt_buf;
+   long b, size;
+   int i;
+
+   for (b = jb->first; b < jb->last; b++)
+   {
+      _line_blk *blk = jb->blks[b];
+
+      if (!may_hold_text(blk, jb->fd.txt, jb->fd.len))
+         continue;
+
+      if ((txt_buf->file != NULL) && (blk->orig >= 0))
+      {
+         size = blk->bytes;                          //the last newline may be missing
+         if (blk->orig + size > txt_buf->file_size)
+            size = txt_buf->file_size - blk->orig;
+
+         if (scan_find(&txt_buf->file[blk->orig], size, jb->fd.txt, jb->fd.len) < 0)
+            continue;
+      }
+
+      for (i = 0; i < blk->count; i++)
+         replace_in_line(jb, &blk->line[i], jb->starts[b] + i);
+   } //for
+
+   return(NULL);
+}
+
+
+void replace_in_line(_replace_job *jb, _line *ln, long n)
+{
+   //finds where the text is in line n, and if it is rebuilds the line with
+   //every one of them replaced, in a single allocation
+
+   char *txt = flat_line_text(&jb->fd, ln), *dst;
+   long k = 0, at = 0, hit, len, i, from;
+
+   while ((hit = scan_find(&txt[at], ln->len - at, jb->fd.txt, jb->fd.len)) >= 0)
+   {
+      if (k == jb->at_size)
+      {
+         jb->at_size = 2 * jb->at_size + 16;
+         jb->at = realloc(jb->at, jb->at_size * sizeof(long));
+      }
+
+      jb->at[k++] = at + hit;
+      at += hit + jb->fd.len;
+   } //while
+
+   len = ln->len + k * (jb->with_len - jb->fd.len);
+   if ((k == 0) || (len > INT_MAX))                    //not there, or it wouldn't fit
+      return;
+
+   dst = (len > 0) ? malloc(len) : NULL;
+
+   for (i = 0, at = 0, from = 0; i < k; i++)
+   {
+      memcpy(&dst[at], &txt[from], jb->at[i] - from);
+      at += jb->at[i] - from;
+      memcpy(&dst[at], jb->with, jb->with_len);
+      at += jb->with_len;
+      from = jb->at[i] + jb->fd.len;
+   }
+   memcpy(&dst[at], &txt[from], ln->len - from);
+
+   if (jb->count == jb->size)
+   {
+      jb->size = 2 * jb->size + 64;
+      jb->lines = realloc(jb->lines, jb->size * sizeof(_new_line));
+   }
+
+   jb->lines[jb->count].n = n;
+   jb->lines[jb->count].txt = dst;
+   jb->lines[jb->count].len = len;
+   jb->count++;
+   jb->found += k;
+}
+
+
+_regex *compile_regex(char *pat)
+{
+   //compiles a regex into an NFA: characters, '.', [classes], \d \w \s and
+   //their opposites, ^ and $, groups, alternatives, and * + ? {m,n}
+   //repeats. err is set to why if it doesn't compile
+
+   _regex *re = calloc(1, sizeof(_regex));
+   char *p = pat;
+   int tail, match;
+
+   re->start = re_alt(re, &p, &tail);
+
+   if ((re->start >= 0) && (*p != '\0'))
+      re->err = "unmatched )";
+   if (re->err != NULL)
+      return(re);
+
+   if ((match = re_add_state(re, _RE_MATCH, 0)) < 0)
+      return(re);
+   re_patch(re, tail, match);
+
+   re_classes(re);
+   re_literal(re);
+
+   return(re);
+}
+
+
+void free_regex(_regex *re)
+{
+   //frees a compiled regex
+
+   if (re == NULL)
+      return;
+
+   free(re->state);
+   free(re->set);
+   free(re);
+}
+
+
+int re_alt(_regex *re, char **p, int *tail)
+{
+   //compiles alternatives, separated by '|'; returns the state they start
+   //from, -1 on error, and tail is set to the list of their loose ends
+
+   int start = re_concat(re, p, tail), s, t, split;
+
+   while ((start >= 0) && (**p == '|'))
+   {
+      (*p)++;
+      if (((s = re_concat(re, p, &t)) < 0) || ((split = re_add_state(re, _RE_SPLIT, 0)) < 0))
+         return(-1);
+
+      re->state[split].out = start;
+      re->state[split].out1 = s;
+      *tail = re_join(re, *tail, t);
+      start = split;
+   } //while
+
+   return(start);
+}
+
+
+int re_concat(_regex *re, char **p, int *tail)
+{
+   //compiles what's matched one after the other, up to a '|' or ')'
+
+   int start = -1, s, t;
+
+   while ((**p != '\0') && (**p != '|') && (**p != ')'))
+   {
+      if ((s = re_repeat(re, p, &t)) < 0)
+         return(-1);
+
+      if (start < 0)
+         start = s;
+      else
+         re_patch(re, *tail, s);
+      *tail = t;
+   } //while
+
+   if ((start < 0) && ((start = re_add_state(re, _RE_EMPTY, 0)) >= 0))
+      *tail = 2 * start;                     //nothing at all
+
+   return(start);
+}
+
+
+int re_repeat(_regex *re, char **p, int *tail)
+{
+   //compiles an atom and any repeats of it; {m,n} compiles the atom again
+   //for each copy of it
+
+   char *from = *p, *to, *copy, *q;
+   int start = re_atom(re, p, tail), m, n, i, s, t, first, first_tail;
+
+   while ((start >= 0) && (strchr("*+?{", **p) != NULL) && (**p != '\0'))
+   {
+      to = (*p)++;
+
+      if (*to == '*')
+         start = re_loop(re, start, tail, TRUE, TRUE);
+      else if (*to == '+')
+         start = re_loop(re, start, tail, FALSE, TRUE);
+      else if (*to == '?')
+         start = re_loop(re, start, tail, TRUE, FALSE);
+      else
+      {
+         m = n = strtol(*p, &q, 10);
+         if ((q != *p) && (*q == ','))
+         {
+            q++;
+            n = ((*q >= '0') && (*q <= '9')) ? strtol(q, &q, 10) : -1;
+         }
+
+         if ((q == *p) || (*q != '}') || ((n >= 0) && (n < m)) || (m > 1000) || (n > 1000))
+         {
+            re->err = "bad {m,n}";
+            return(-1);
+         }
+         *p = q + 1;
+
+         //the copy already compiled comes first, then copies compiled from the
+         //text of it; past the m needed they're optional, or all repeat
+         copy = strndup(from, to - from);
+         first = start;
+         first_tail = *tail;
+
+         for (i = 0, start = -1; (i < ((n < 0) ? m + 1 : n)) && (first >= 0); i++)
+         {
+            q = copy;
+            s = (i == 0) ? first : re_repeat(re, &q, &t);
+            t = (i == 0) ? first_tail : t;
+
+            if ((s >= 0) && (i >= m))
+               s = re_loop(re, s, &t, TRUE, (n < 0));
+
+            if (s < 0)
+               first = -1;
+            else if (start < 0)
+               start = s;
+            else
+               re_patch(re, *tail, s);
+            *tail = t;
+         } //for
+         free(copy);
+
+         if (first < 0)
+            return(-1);
+         if ((start < 0) && ((start = re_add_state(re, _RE_EMPTY, 0)) >= 0))
+            *tail = 2 * start;               //{0}
+      }
+   } //while
+
+   return(start);
+}
+
+
+int re_loop(_regex *re, int start, int *tail, int optional, int again)
+{
+   //makes what starts at start optional (?), repeated (+), or both (*)
+
+   int split = re_add_state(re, _RE_SPLIT, 0);
+
+   if (split < 0)
+      return(-1);
+
+   re->state[split].out = start;
+
+   if (again)
+      re_patch(re, *tail, split);
+   *tail = (again) ? 2 * split + 1 : re_join(re, *tail, 2 * split + 1);
+
+   return((optional) ? split : start);
+}
+
+
+int re_atom(_regex *re, char **p, int *tail)
+{
+   //compiles a single character, set of them, anchor or group
+
+   int c = *(*p)++, s, set;
+
+   if (c == '(')
+   {
+      if ((s = re_alt(re, p, tail)) < 0)
+         return(-1);
+      if (**p != ')')
+      {
+         re->err = "missing )";
+         return(-1);
+      }
+
+      (*p)++;
+      return(s);
+   }
+
+   if ((c == '*') || (c == '+') || (c == '?') || (c == '{'))
+   {
+      re->err = "nothing to repeat";
+      return(-1);
+   }
+
+   if ((c == '^') || (c == '$'))
+   {
+      if ((s = re_add_state(re, (c == '^') ? _RE_BOL : _RE_EOL, 0)) >= 0)
+         *tail = 2 * s;
+      return(s);
+   }
+
+   if ((set = re_add_set(re)) < 0)
+      return(-1);
+
+   if (c == '[')
+   {
+      if (!re_class(re, p, re->set[set]))
+         return(-1);
+   }
+   else if (c == '.')
+      memset(re->set[set], 0xff, 32);
+   else if (c == '\\')
+   {
+      if (**p == '\0')
+      {
+         re->err = "\\ at the end";
+         return(-1);
+      }
+      re_escape(re->set[set], *(*p)++);
+   }
+   else
+      re->set[set][(unsigned char) c >> 3] |= 1 << (c & 7);
+
+   if ((s = re_add_state(re, _RE_SET, set)) >= 0)
+      *tail = 2 * s;
+
+   return(s);
+}
+
+
+int re_class(_regex *re, char **p, unsigned char *set)
+{
+   //compiles a [class] of characters into set, returns FALSE on error; a
+   //']' right at the start is one of the characters
+
+   int negate = (**p == '^'), c, to, i;
+   char *open;
+
+   *p += negate;
+   open = *p;
+
+   for (c = *(*p)++; (c != ']') || (*p - 1 == open); c = *(*p)++)
+   {
+      if (c == '\0')
+      {
+         re->err = "missing ]";
+         return(FALSE);
+      }
+
+      if ((c == '\\') && (**p != '\0') && (strchr("dDwWsS", **p) != NULL))
+      {
+         re_escape(set, *(*p)++);
+         continue;
+      }
+
+      if ((c == '\\') && (**p != '\0'))
+         c = *(*p)++;
+
+      to = c;
+      if (((*p)[0] == '-') && ((*p)[1] != ']') && ((*p)[1] != '\0'))
+      {
+         to = (*p)[1];
+         *p += 2;
+         if ((to == '\\') && (**p != '\0'))
+            to = *(*p)++;
+      }
+
+      for (i = (unsigned char) c; i <= (unsigned char) to; i++)
+         set[i >> 3] |= 1 << (i & 7);
+   } //for
+
+   if (negate)
+      for (i = 0; i < 32; i++)
+         set[i] = ~set[i];
+
+   return(TRUE);
+}
+
+
+void re_escape(unsigned char *set, int c)
+{
+   //adds the characters of \d \w \s (or \D \W \S, all but those) to set,
+   //or the character itself when escaped
+
+   unsigned char add[32];
+   int i, lower = c | 32;
+
+   memset(add, 0, 32);
+
+   for (i = 0; i < 256; i++)
+      if (((lower == 'd') && (isdigit(i))) || ((lower == 'w') && ((isalnum(i)) || (i == '_'))) ||
+          ((lower == 's') && (isspace(i))))
+         add[i >> 3] |= 1 << (i & 7);
+
+   if (strchr("dws", lower) == NULL)
+      add[(unsigned char) c >> 3] |= 1 << (c & 7);
+   else if (c != lower)
+      for (i = 0; i < 32; i++)
+         add[i] = ~add[i];
+
+   for (i = 0; i < 32; i++)
+      set[i] |= add[i];
+}
+
+
+int re_add_state(_regex *re, int op, int set)
+{
+   //adds a state to the regex, going nowhere yet; returns it, -1 if the
+   //regex is too big
+
+   if (re->n_states == _RE_STATES)
+   {
+      re->err = "too big";
+      return(-1);
+   }
+
+   if (re->n_states == re->max_states)
+   {
+      re->max_states = 2 * re->max_states + 16;
+      re->state = realloc(re->state, re->max_states * sizeof(_re_state));
+   }
+
+   re->state[re->n_states].op = op;
+   re->state[re->n_states].set = set;
+   re->state[re->n_states].out = -1;
+   re->state[re->n_states].out1 = -1;
+
+   return(re->n_states++);
+}
+
+
+int re_add_set(_regex *re)
+{
+   //adds an empty set of characters to the regex, returns it
+
+   if (re->n_sets == _RE_STATES)
+   {
+      re->err = "too big";
+      return(-1);
+   }
+
+   if (re->n_sets == re->max_sets)
+   {
+      re->max_sets = 2 * re->max_sets + 16;
+      re->set = realloc(re->set, re->max_sets * 32);
+   }
+
+   memset(re->set[re->n_sets], 0, 32);
+
+   return(re->n_sets++);
+}
+
+
+//loose ends: a list of the outs of states not going anywhere yet, each 2 * the
+//state, + 1 for its out1. the list runs through the outs themselves, each
+//holding -2 - the next one, -1 at the end
+
+void re_patch(_regex *re, int list, int to)
+{
+   //points all the loose ends on the list at state to
+
+   while (list != -1)
+   {
+      int *out = (list & 1) ? &re->state[list / 2].out1 : &re->state[list / 2].out;
+
+      list = (*out == -1) ? -1 : -2 - *out;
+      *out = to;
+   }
+}
+
+
+int re_join(_regex *re, int list, int list2)
+{
+   //returns the two lists of loose ends made one
+
+   int at = list, *out;
+
+   while (TRUE)
+   {
+      out = (at & 1) ? &re->state[at / 2].out1 : &re->state[at / 2].out;
+      if (*out == -1)
+         break;
+      at = -2 - *out;
+   }
+
+   *out = -2 - list2;
+
+   return(list);
+}
+
+
+void re_classes(_regex *re)
+{
+   //splits the characters into classes no set of the regex tells apart,
+   //refining them one set at a time; the DFA goes by class, not character
+
+   int map[512], i, k, n = 1;
+
+   memset(re->cls, 0, 256);
+
+   for (k = 0; k < re->n_sets; k++)
+   {
+      memset(map, -1, sizeof(map));
+
+      for (i = 0, n = 0; i < 256; i++)
+      {
+         int key = 2 * re->cls[i] + ((re->set[k][i >> 3] >> (i & 7)) & 1);
+
+         if (map[key] < 0)
+            map[key] = n++;
+         re->cls[i] = map[key];
+      }
+   } //for
+
+   for (i = 255; i >= 0; i--)
+      re->rep[re->cls[i]] = i;
+
+   re->n_cls = n;
+}
+
+
+void re_literal(_regex *re)
+{
+   //finds the text every match starts with: the single characters the
+   //regex starts with, one after the other, up to anything else
+
+   _re_state *st;
+   int s = re->start, i, c = 0, n;
+
+   while ((s >= 0) && (re->lit_len < _FIND_LEN - 1))
+   {
+      st = &re->state[s];
+
+      if (st->op == _RE_EMPTY)
+      {
+         s = st->out;
+         continue;
+      }
+      if (st->op != _RE_SET)
+         break;
+
+      for (i = 0, n = 0; i < 256; i++)
+         if ((re->set[st->set][i >> 3] >> (i & 7)) & 1)
+         {
+            c = i;
+            n++;
+         }
+      if (n != 1)
+         break;
+
+      re->lit[re->lit_len++] = c;
+      s = st->out;
+   } //while
+}
+
+
+void init_dfa(_dfa *d, _regex *re, int anchored)
+{
+   //readies a DFA for the regex, with no states built yet
+
+   memset(d, 0, sizeof(_dfa));
+
+   d->re = re;
+   d->anchored = anchored;
+   d->width = re->n_cls + 2;
+   d->max_states = _RE_DFA_STATES;
+   d->next = malloc((long) d->max_states * d->width * sizeof(int));
+   d->accept = malloc(d->max_states);
+   d->at = malloc(d->max_states * sizeof(long));
+   d->len = malloc(d->max_states * sizeof(int));
+   d->hash_size = 2 * d->max_states;
+   d->hash = malloc(d->hash_size * sizeof(int));
+   d->work = malloc((re->n_states + 1) * sizeof(int));
+   d->stack = malloc((2 * re->n_states + 2) * sizeof(int));
+   d->mark = calloc(re->n_states + 1, sizeof(int));
+
+   reset_dfa(d);
+}
+
+
+void reset_dfa(_dfa *d)
+{
+   //forgets all the states built, when there are too many of them
+
+   d->n_states = 0;
+   d->pool_used = 0;
+   d->start = -1;
+   memset(d->hash, -1, d->hash_size * sizeof(int));
+}
+
+
+void free_dfa(_dfa *d)
+{
+   //frees a DFA
+
+   free(d->next);
+   free(d->accept);
+   free(d->at);
+   free(d->len);
+   free(d->pool);
+   free(d->hash);
+   free(d->work);
+   free(d->stack);
+   free(d->mark);
+}
+
+
+int cmp_int(const void *a, const void *b)
+{
+   //compares ints, for qsort
+
+   return(*(int*) a - *(int*) b);
+}
+
+
+int dfa_state(_dfa *d, int *set, int n)
+{
+   //returns the state for the set of n regex states, adding it if it's new;
+   //-1 if there's no room for it
+
+   unsigned int h = 2166136261u;
+   int i, s;
+
+   qsort(set, n, sizeof(int), cmp_int);
+   for (i = 0; i < n; i++)
+      h = (h ^ set[i]) * 16777619u;
+
+   for (h %= d->hash_size; (s = d->hash[h]) >= 0; h = (h + 1) % d->hash_size)
+      if ((d->len[s] == n) && (memcmp(&d->pool[d->at[s]], set, n * sizeof(int)) == 0))
+         return(s);
+
+   if (d->n_states == d->max_states)
+      return(-1);
+
+   if (d->pool_used + n > d->pool_size)
+   {
+      d->pool_size = 2 * d->pool_size + n + 1024;
+      d->pool = realloc(d->pool, d->pool_size * sizeof(int));
+   }
+
+   s = d->n_states++;
+   d->hash[h] = s;
+   d->at[s] = d->pool_used;
+   d->len[s] = n;
+   memcpy(&d->pool[d->pool_used], set, n * sizeof(int));
+   d->pool_used += n;
+
+   d->accept[s] = FALSE;
+   for (i = 0; i < n; i++)
+      d->accept[s] |= (d->re->state[set[i]].op == _RE_MATCH);
+   for (i = 0; i < d->width; i++)
+      d->next[(long) s * d->width + i] = -1;
+
+   return(s);
+}
+
+
+void re_closure(_dfa *d, int s, int *n, int anchor)
+{
+   //adds state s to the set being built in work, and all the states it goes
+   //on to without taking a character, past any more of the anchor (_RE_BOL
+   //or _RE_EOL, 0 for none) being taken; only those that take one are kept
+
+   _re_state *st;
+   int k = 0;
+
+   d->stack[k++] = s;
+
+   while (k > 0)
+   {
+      if (((s = d->stack[--k]) < 0) || (d->mark[s] == d->gen))
+         continue;
+
+      d->mark[s] = d->gen;
+      st = &d->re->state[s];
+
+      if (st->op == _RE_SPLIT)
+      {
+         d->stack[k++] = st->out1;
+         d->stack[k++] = st->out;
+      }
+      else if ((st->op == _RE_EMPTY) || (st->op == anchor))
+         d->stack[k++] = st->out;
+      else
+         d->work[(*n)++] = s;
+   } //while
+}
+
+
+int dfa_start(_dfa *d)
+{
+   //returns the state the DFA starts in
+
+   int n = 0;
+
+   if (d->start >= 0)
+      return(d->start);
+
+   d->gen++;
+   re_closure(d, d->re->start, &n, 0);
+
+   if ((d->start = dfa_state(d, d->work, n)) < 0)
+   {
+      reset_dfa(d);
+      d->start = dfa_state(d, d->work, n);
+   }
+
+   return(d->start);
+}
+
+
+int dfa_next(_dfa *d, int s, int sym)
+{
+   //works out where state s goes on sym, a class or the line start or end,
+   //the first time it's taken. the line start and end only move the states
+   //waiting for them, the rest stay; once the DFA is full it starts over,
+   //and what's returned is then the only state still valid
+
+   _regex *re = d->re;
+   int i, n = 0, t, *set = &d->pool[d->at[s]];
+   int anchor = (sym == re->n_cls) ? _RE_BOL : _RE_EOL;
+
+   d->gen++;
+
+   for (i = 0; i < d->len[s]; i++)
+   {
+      _re_state *st = &re->state[set[i]];
+
+      if (sym < re->n_cls)
+      {
+         if ((st->op == _RE_SET) && ((re->set[st->set][re->rep[sym] >> 3] >> (re->rep[sym] & 7)) & 1))
+            re_closure(d, st->out, &n, 0);
+      }
+      else if (st->op == anchor)
+         re_closure(d, st->out, &n, anchor);
+      else if (d->mark[set[i]] != d->gen)
+      {
+         d->mark[set[i]] = d->gen;
+         d->work[n++] = set[i];
+      }
+   } //for
+
+   if ((!d->anchored) && (sym < re->n_cls))      //a match could start after it too
+      re_closure(d, re->start, &n, 0);
+
+   if ((t = dfa_state(d, d->work, n)) < 0)
+   {
+      reset_dfa(d);
+      return(dfa_state(d, d->work, n));
+   }
+
+   d->next[(long) s * d->width + sym] = t;
+   return(t);
+}
+
+
+void init_re_scan(_re_scan *rs, _regex *re)
+{
+   //readies a regex for running, each thread running it needs its own
+
+   init_dfa(&rs->find, re, FALSE);
+   init_dfa(&rs->match, re, TRUE);
+}
+
+
+void free_re_scan(_re_scan *rs)
+{
+   //frees what running a regex took
+
+   free_dfa(&rs->find);
+   free_dfa(&rs->match);
+}
+
+
+int regex_end(_dfa *d, char *txt, int len, int from)
+{
+   //returns where the first match to end from offset from on in the line
+   //ends, -1 if there's none; the DFA takes a character at a time by its
+   //class, building the states it needs as it goes
+
+   unsigned char *cls = d->re->cls;
+   int i, t, s = dfa_start(d), w = d->width, bol = d->re->n_cls;
+
+   if (from == 0)
+      s = ((t = d->next[(long) s * w + bol]) >= 0) ? t : dfa_next(d, s, bol);
+   if (d->accept[s])
+      return(from);
+
+   for (i = from; i < len; i++)
+   {
+      int c = cls[(unsigned char) txt[i]];
+
+      s = ((t = d->next[(long) s * w + c]) >= 0) ? t : dfa_next(d, s, c);
+      if (d->accept[s])
+         return(i + 1);
+   }
+
+   s = ((t = d->next[(long) s * w + bol + 1]) >= 0) ? t : dfa_next(d, s, bol + 1);
+
+   return((d->accept[s]) ? len : -1);
+}
+
+
+int regex_longest(_dfa *d, char *txt, int len, int from)
+{
+   //returns where the longest match starting right at offset from in the
+   //line ends, -1 if none does
+
+   unsigned char *cls = d->re->cls;
+   int i, t, s = dfa_start(d), w = d->width, bol = d->re->n_cls, end = -1;
+
+   if (from == 0)
+      s = ((t = d->next[(long) s * w + bol]) >= 0) ? t : dfa_next(d, s, bol);
+   end = (d->accept[s]) ? from : end;
+
+   for (i = from; (i < len) && (d->len[s] > 0); i++)   //until nothing can match
+   {
+      int c = cls[(unsigned char) txt[i]];
+
+      s = ((t = d->next[(long) s * w + c]) >= 0) ? t : dfa_next(d, s, c);
+      end = (d->accept[s]) ? i + 1 : end;
+   }
+
+   if ((i == len) && (d->len[s] > 0))
+   {
+      s = ((t = d->next[(long) s * w + bol + 1]) >= 0) ? t : dfa_next(d, s, bol + 1);
+      end = (d->accept[s]) ? len : end;
+   }
+
+   return(end);
+}
+
+
+int regex_in_line(_re_scan *rs, char *txt, int len, int from, int *end)
+{
+   //finds the leftmost match starting from offset from on in the line, the
+   //longest there. returns where it starts, -1 if there's none, and end is
+   //set to where it ends; it can only start up to where the first match ends,
+   //and no sooner than the text all matches start with
+
+   _regex *re = rs->find.re;
+   long at;
+   int e, st;
+
+   if (from > len)
+      return(-1);
+
+   if (re->lit_len > 0)
+   {
+      if ((len - from < re->lit_len) || ((at = scan_find(&txt[from], len - from, re->lit, re->lit_len)) < 0))
+         return(-1);
+      from += at;
+   }
+
+   if ((e = regex_end(&rs->find, txt, len, from)) < 0)
+      return(-1);
+
+   for (st = from; st <= e; st++)
+      if ((*end = regex_longest(&rs->match, txt, len, st)) >= 0)
+         return(st);
+
+   return(-1);
+}
+
+
+long find_regex(_finder *fd, _line *ln, long from)
+{
+   //finds the regex in the line from offset from on, or the last match
+   //starting up to from looking backwards; returns where, -1 if it isn't there
+
+   char *txt = flat_line_text(fd, ln);
+   int st, end, at = 0, last = -1;
+
+   if (!fd->back)
+      return((from <= ln->len) ? regex_in_line(fd->re, txt, ln->len, from, &end) : -1);
+
+   while (((st = regex_in_line(fd->re, txt, ln->len, at, &end)) >= 0) && (st <= from))
+   {
+      last = st;
+      at = (end > st) ? end : st + 1;
+   }
+
+   return(last);
+}
+
+
+long regex_all(_txt_buf *txt_buf, _regex *re, _re_match *list, long *lines, int *threads)
+{
+   //counts the matches of the regex all through the buffer, on threads each
+   //taking a share of the blocks of lines; list is filled with the first
+   //_RE_LIST of them, the threads' first ones merged in order. returns the
+   //number of matches, lines is set to the lines they're on
+
+   int i, n;
+   long count, k, found = 0;
+   _line_blk **blks;
+   long *starts;
+   _regex_job *jobs;
+
+   *lines = 0;
+   if ((*threads = n = share_line_blks(txt_buf, &blks, &starts, &count)) == 0)
+      return(0);
+
+   jobs = calloc(n, sizeof(_regex_job));
+
+   for (i = 0; i < n; i++)
+   {
+      jobs[i].blks = blks;
+      jobs[i].starts = starts;
+      jobs[i].first = (count / n) * i;
+      jobs[i].last = (i == n - 1) ? count : (count / n) * (i + 1);
+      init_re_scan(&jobs[i].rs, re);
+   }
+   run_jobs(jobs, n, sizeof(_regex_job), regex_job);
+
+   for (i = 0; i < n; i++)
+   {
+      for (k = 0; (k < jobs[i].found) && (k < _RE_LIST) && (found + k < _RE_LIST); k++)
+         list[found + k] = jobs[i].list[k];
+
+      found += jobs[i].found;
+      *lines += jobs[i].lines;
+
+      free_re_scan(&jobs[i].rs);
+      free(jobs[i].fd.flat);
+   }
+
+   free(jobs);
+   free(starts);
+   free(blks);
+
+   return(found);
+}
+
+
+void *regex_job(void *job)
+{
+   //counts the matches in a share of the blocks of lines, keeping the first
+   //of them; after an empty match the next can start a character on
+
+   _regex_job *jb = job;
+   long b;
+   int i, st, end, at;
+
+   for (b = jb->first; b < jb->last; b++)
+   {
+      _line_blk *blk = jb->blks[b];
+
+      if (!may_hold_text(blk, jb->rs.find.re->lit, jb->rs.find.re->lit_len))
+         continue;
+
+      for (i = 0; i < blk->count; i++)
+      {
+         _line *ln = &blk->line[i];
+         char *txt = flat_line_text(&jb->fd, ln);
+         long found = jb->found;
+
+         for (at = 0; (st = regex_in_line(&jb->rs, txt, ln->len, at, &end)) >= 0;
+              at = (end > st) ? end : st + 1)
+         {
+            if (jb->found < _RE_LIST)
+            {
+               jb->list[jb->found].n = jb->starts[b] + i;
+               jb->list[jb->found].offset = st;
+               jb->list[jb->found].len = end - st;
+            }
+            jb->found++;
+         }
+
+         jb->lines += (jb->found > found);
+      } //for
+   } //for
+
+   return(NULL);
+}
+
+
+void fix_cursor(_cursor_inst *cursor)
+{
+   //fixes the cursor if the screen was initialized or resized
+
+   _display_cursor_update(cursor);   //adjusts the screen dimensions
+
+   cursor->max_y -= 3;               //adjust for scrollbars/last scroll-line
+   cursor->max_x -= 2;
+   cursor->min_y = 1;                //adjust for title
+   cursor->min_x = 8;                //adjust for line numbers
+
+   cursor->x = cursor->min_x;        //move the cursor to the top left
+   cursor->y = cursor->min_y;        //corner
+
+   size_frame(cursor->max_y + 3, cursor->max_x + 2);
+}
+
+
+void fix_cursor_gutter(_cursor_inst *cursor)
+{
+   //widens the line number area once the numbers on display need more
+   //than six digits, keeping the cursor over the same character
+
+   long n = cursor->buf_y + cursor->max_y + 1;          //last line number on display
+   int min_x = 2;
+
+   for (; n > 0; n /= 10)
+      min_x++;
+   min_x = (min_x < 8) ? 8 : min_x;
+
+   cursor->x += min_x - cursor->min_x;
+   cursor->min_x = min_x;
+}
+
+
+void move_cursor_to_target(_cursor_inst *cursor, int offset, long linenum)
+{
+   //moves cursor, taking into account scrolling etc. to the specified
+   //location in the active text currently in the buffer; in one go, but
+   //ending up just where stepping there with move_cursor() would
+
+   long d, k;
+
+   d = offset - (cursor->x - cursor->min_x + cursor->buf_x);
+   if (d > 0)                                           //right up to the cushion, then scroll
+   {
+      k = (cursor->max_x - cursor->cushion + 1) - cursor->x;
+      k = (k < 0) ? 0 : ((k > d) ? d : k);
+      cursor->x += k;
+      cursor->buf_x += d - k;
+   }
+   else if (d < 0)                                      //left to the cushion, scroll, then
+   {                                                    //the rest of the way
+      d = -d;
+      k = cursor->x - (cursor->min_x + cursor->cushion);
+      k = (k < 0) ? 0 : ((k > d) ? d : k);
+      cursor->x -= k;
+      d -= k;
+      k = (cursor->buf_x > d) ? d : cursor->buf_x;
+      cursor->buf_x -= k;
+      cursor->x -= d - k;
+   }
+
+   d = linenum - (cursor->buf_y + (cursor->y - cursor->min_y));
+   if (d > 0)                                           //down to the bottom, then scroll
+   {
+      k = (cursor->max_y + 1) - cursor->y;
+      k = (k < 0) ? 0 : ((k > d) ? d : k);
+      cursor->y += k;
+      cursor->buf_y += d - k;
+   }
+   else if (d < 0)                                      //up to the top, then scroll
+   {
+      d = -d;
+      k = (cursor->y - cursor->min_y > d) ? d : cursor->y - cursor->min_y;
+      cursor->y -= k;
+      d -= k;
+      cursor->buf_y -= (cursor->buf_y > d) ? d : cursor->buf_y;
+   }
+}
+
+
+void move_cursor_into_view(_txt_buf *txt_buf, _cursor_inst *cursor, int offset, long linenum)
+{
+   //moves the cursor to the location, bringing it to the middle of the
+   //screen if it's not on the screen as it is
+
+   int on_screen = (linenum >= cursor->buf_y) && (linenum <= cursor->buf_y + cursor->max_y);
+
+   move_cursor_to_target(cursor, offset, linenum);
+   if (!on_screen)                                      //far off, bring it to the middle
+      move_cursor(txt_buf, cursor, _KB_CTRL_L);
+}
+
+
+int move_cursor(_txt_buf *txt_buf, _cursor_inst *cursor, int direction)
+{
+   //moves the cursor in the specified direction, making sure to
+   //take the display, buffer offset, and cushion into account
+
+   int update = TRUE;  //assume something will happen, if not later set to FALSE
+
+   switch(direction)
+   {
+      case _KB_UP:
+      {
+         if (cursor->y > cursor->min_y)                         //move cursor up
+            cursor->y--;
+         else if (cursor->buf_y > 0)                            //scroll up
+            cursor->buf_y--;
+         else 
+            update = FALSE;
+
+         break;
+      }
+
+      case _KB_DN:
+      {
+         if (cursor->y <= cursor->max_y)                        //move cursor down
+            cursor->y++;
+         else                                                   //scroll down
+            cursor->buf_y++;
+
+         break;
+      }
+
+      case _KB_LF:
+      {
+         if (cursor->x > (cursor->min_x + cursor->cushion))     //move cursor left
+            cursor->x--;
+         else if (cursor->buf_x > 0)                            //scroll left
+            cursor->buf_x--;
+         else if (cursor->x > cursor->min_x)                    //no more scroll, only move
+            cursor->x--;
+         else if (cursor->x == cursor->min_x)                   //beginnig of line, move to
+         {                                                      //end of previous line
+            if (move_cursor(txt_buf, cursor, _KB_UP))
+               move_cursor(txt_buf, cursor, _KB_ED);
+         }
+
+         break;
+      }
+
+      case _KB_RT:
+      {
+         if (cursor->x <= (cursor->max_x - cursor->cushion))    //move cursor right
+            cursor->x++;
+         else                                                   //scroll right
+            cursor->buf_x++;
 
          break;
       }
@@ -819,14 +5954,12 @@ int move_cursor(char ***txt_buf, _cursor_inst *cursor, int direction)
       case _KB_ED:
       case _KB_CTRL_BKSLSH:
       {
-         long txt_count = cursor->buf_y + (cursor->y - cursor->min_y);
-         int txt_c_1 = txt_count / _MAX_LINES;
-         int txt_c_2 = txt_count % _MAX_LINES;
+         _line *line = get_line(txt_buf, cursor->buf_y + (cursor->y - cursor->min_y));
 
-         //move to end of line or to first position
+         //move to end of line or to first position, counting the _ENDCHAR
          int line_len = 1;
-         if ((txt_buf[txt_c_1] != NULL) && (txt_buf[txt_c_1][txt_c_2] != NULL))
-            line_len = strlen(txt_buf[txt_c_1][txt_c_2]);
+         if (line != NULL)
+            line_len = line->len + 1;
 
          if (line_len < (cursor->max_x - cursor->cushion))
          {
@@ -854,6 +5987,8 @@ int move_cursor(char ***txt_buf, _cursor_inst *cursor, int direction)
 
       case _KB_CTRL_N:
       {
+         wait_for_lines(txt_buf, LONG_MAX);                          //the end must be in
+
          cursor->buf_y = num_lines(txt_buf) - cursor->cushion;       //end of buffer
          cursor->buf_y = (cursor->buf_y < 0) ? 0 : cursor->buf_y;
          cursor->y = cursor->min_y + (num_lines(txt_buf) - cursor->buf_y) - 1;
@@ -893,85 +6028,59 @@ int move_cursor(char ***txt_buf, _cursor_inst *cursor, int direction)
 }
 
 
-int move_cursor_advanced(char*** txt_buf, _cursor_inst *cursor, int key)
+int move_cursor_advanced(_txt_buf *txt_buf, _cursor_inst *cursor, int key)
 {
    //does all the more complex cursor operations
 
-   char *new_str;
-   int i, j, line_len, update = 0;
+   int i, j, update = 0;
 
    long txt_count = cursor->buf_y + (cursor->y - cursor->min_y);
-   int txt_c_1 = txt_count / _MAX_LINES;
-   int txt_c_2 = txt_count % _MAX_LINES;
+   _line *line = get_line(txt_buf, txt_count);
    int offset = cursor->x - cursor->min_x + cursor->buf_x;
 
+   if ((view_only) && (key != _KB_CTRL_D))     //nothing changes in view mode
+      return(update);
 
    switch(key)
    {
       case _KB_CTRL_X:
       {
+         //lines may have gone from under the selection since it was made
+         if (cursor->clip_bt_off >= num_lines(txt_buf))
+            cursor->clip_bt_off = num_lines(txt_buf) - 1;
+         if (cursor->clip_tp_off > cursor->clip_bt_off)
+            cursor->clip_type = -1;
+
          if (cursor->clip_type == 1)           //clip off a single line
          {
-            //assign some new space for the clipped text
-            free(cursor->clip);
-            cursor->clip = malloc((cursor->clip_rt_off - cursor->clip_lf_off + 2) * sizeof(char));
-
-            //get the cursor where we want it
-            move_cursor_to_target(txt_buf, cursor, cursor->clip_rt_off, cursor->clip_tp_off);
-            offset = cursor->x - cursor->min_x + cursor->buf_x;
-            txt_count = cursor->buf_y + (cursor->y - cursor->min_y);
-
-            //copy the new text into the clipboard string
-            memcpy(&cursor->clip[0],
-                   &txt_buf[txt_count / _MAX_LINES][txt_count % _MAX_LINES][cursor->clip_lf_off], 
-                   (cursor->clip_rt_off - cursor->clip_lf_off + 1));
-            cursor->clip[(cursor->clip_rt_off - cursor->clip_lf_off + 1)] = '\0';
-
-            //erase all the text we just copied
-            move_cursor(txt_buf, cursor, _KB_RT);
-            for (i = cursor->clip_rt_off + 1; i > cursor->clip_lf_off; i--)
-               move_cursor_advanced(txt_buf, cursor, _KB_BKS);
+            //take the text out into the clipboard in one go
+            free(cursor->clip.txt);
+            cursor->clip = buf_extract_range(txt_buf, cursor->clip_tp_off, cursor->clip_lf_off,
+                                             cursor->clip_tp_off, cursor->clip_rt_off + 1);
+
+            move_cursor_to_target(cursor, cursor->clip_lf_off, cursor->clip_tp_off);
          }
          else if (cursor->clip_type == 2)      //clip multiple lines
          {
-            //free and initialize the clipped text space
-            free(cursor->clip);
-            cursor->clip = malloc(sizeof(char));
-            cursor->clip[0] = '\0';
-
             //if we're cutting the first line, leave some breathing space
             if (cursor->clip_tp_off == 0)
             {
-               move_cursor_to_target(txt_buf, cursor, 0, cursor->clip_tp_off);
+               move_cursor_to_target(cursor, 0, cursor->clip_tp_off);
                move_cursor_advanced(txt_buf, cursor, _KB_ENT);
                cursor->clip_tp_off++;
                cursor->clip_bt_off++;
             }
 
-            //get the cursor where we want it
-            move_cursor_to_target(txt_buf, cursor, 1, cursor->clip_bt_off);
-            move_cursor(txt_buf, cursor, _KB_ED);
-            txt_count = cursor->buf_y + (cursor->y - cursor->min_y);
+            //everything from the end of the line above to the end of the last
+            //line goes, so the clip starts with the '\n' that joined them
+            txt_count = cursor->clip_tp_off - 1;
+            offset = get_line(txt_buf, txt_count)->len;
 
-            //record and delete, sequentially, going backwards
-            //making sure we aren't stuck on first line in an infinite loop
-            while ((txt_count != (cursor->clip_tp_off - 1)) && !((txt_count == 0) && (offset == 0)))
-            {
-               int txt_count_old = cursor->buf_y + (cursor->y - cursor->min_y);
-               offset = cursor->x - cursor->min_x + cursor->buf_x;
-
-               if (offset > 0)                 //can record a character
-                  cursor->clip = add_char_to_line(cursor->clip, 
-                      txt_buf[txt_count_old / _MAX_LINES][txt_count_old % _MAX_LINES][offset - 1],
-                      0, strlen(cursor->clip));
+            free(cursor->clip.txt);
+            cursor->clip = buf_extract_range(txt_buf, txt_count, offset, cursor->clip_bt_off,
+                                             get_line(txt_buf, cursor->clip_bt_off)->len);
 
-               move_cursor_advanced(txt_buf, cursor, _KB_BKS);
-
-               //if we moved up a line, put an '\n' into the clip string we're building
-               txt_count = cursor->buf_y + (cursor->y - cursor->min_y);
-               if ((txt_count_old != txt_count) && (txt_count_old != 0))
-                  cursor->clip = add_char_to_line(cursor->clip, '\n', 0, strlen(cursor->clip));
-            }
+            move_cursor_to_target(cursor, offset, txt_count);
          }
 
          cursor->data_type = ((cursor->clip_type == 1) || (cursor->clip_type == 2));
@@ -983,11 +6092,9 @@ int move_cursor_advanced(char*** txt_buf, _cursor_inst *cursor, int key)
 
       case _KB_CTRL_D:
       {
-         if (((txt_buf[txt_c_1] != NULL)) && ((txt_buf[txt_c_1][txt_c_2] != NULL)))
+         if (line != NULL)
          {
-            int curlen = strlen(txt_buf[txt_c_1][txt_c_2]);
-
-            if (offset < (curlen - 1))                //selections only work on active text
+            if (offset < line->len)                   //selections only work on active text
             {
                if (cursor->clip_type == 0)            //second point selection
                {
@@ -1016,15 +6123,54 @@ int move_cursor_advanced(char*** txt_buf, _cursor_inst *cursor, int key)
          break;
       }
 
+      case _KB_CTRL_R:
+      {
+         update = replace_and_show(txt_buf, cursor);
+         cursor->clip_type = -1;                     //deselect
+         break;
+      }
+
+      case _KB_CTRL_Z:
+      case _KB_CTRL_A:
+      {
+         long n;
+         int at;
+
+         if (undo_edits(txt_buf, (key == _KB_CTRL_A), &n, &at))
+            move_cursor_to_target(cursor, at, n);   //show where it was
+         else
+            strcpy(status_msg, (key == _KB_CTRL_A) ? "nothing to redo" : "nothing to undo");
+
+         cursor->clip_type = -1;                     //deselect
+
+         update = 1;
+         break;
+      }
+
       case _KB_CTRL_V:
       {
-         int clip_len = strlen(cursor->clip);
+         //splice the clipboard into the buffer at the cursor in one go,
+         //then put the cursor straight at the end of it
+         if ((cursor->data_type == 1) && (cursor->clip.len > 0))
+         {
+            _line *clip = &cursor->clip;
+            char *p, *nl, *end = &clip->txt[clip->len];
+
+            init_blank_lines(txt_buf, txt_count);
+            move_line_gap(clip, clip->len);           //all the text in one piece
+
+            //a newline first splits the line where it ends, without padding
+            if ((clip->txt[0] == '\n') && (offset > get_line(txt_buf, txt_count)->len))
+               offset = get_line(txt_buf, txt_count)->len;
+
+            buf_insert_text(txt_buf, txt_count, offset, clip->txt, clip->len);
 
-         //roll through the clipboard data and spit the characters
-         //into the buffer starting at the current cursor location
-         if ((cursor->data_type == 1) && (cursor->clip != NULL))
-            for (i = 0; i < clip_len; i++)
-               move_cursor_advanced(txt_buf, cursor, cursor->clip[i]);
+            for (p = clip->txt; (nl = memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+               txt_count++;
+
+            move_cursor_to_target(cursor, (p == clip->txt) ? offset + clip->len : end - p,
+                                  txt_count);
+         }
 
          cursor->clip_type = -1;                     //deselect
 
@@ -1034,12 +6180,8 @@ int move_cursor_advanced(char*** txt_buf, _cursor_inst *cursor, int key)
 
       case _KB_BKS:
       {
-         if (((txt_buf[txt_c_1] != NULL)) && ((txt_buf[txt_c_1][txt_c_2] != NULL)))
+         if (line != NULL)
          {
-            //we'll need this to adjust all the subsequent text up a line
-            long lst_count = num_lines(txt_buf);
-            int curlen = strlen(txt_buf[txt_c_1][txt_c_2]);
-
             //move the line up and to the end of the previous line...
             if ((offset == 0) && (txt_count != 0))
             {
@@ -1047,226 +6189,582 @@ int move_cursor_advanced(char*** txt_buf, _cursor_inst *cursor, int key)
                move_cursor(txt_buf, cursor, _KB_UP);
                move_cursor(txt_buf, cursor, _KB_ED);
 
-               //build the new string from this line and the previous one
-               line_len =
-                  strlen(txt_buf[(txt_count - 1) / _MAX_LINES][(txt_count - 1) % _MAX_LINES]);
+               //fuse this line onto the end of the previous one, the
+               //lines after it move up on their own
+               buf_join_lines(txt_buf, txt_count - 1);
+            }
+
+            //delete a character...
+            else if ((offset <= line->len) && (offset != 0))
+            {
+               buf_del_char(txt_buf, txt_count, offset);
+               move_cursor(txt_buf, cursor, _KB_LF);
+            }
+
+            //or move to the end of the line if we're not in active text
+            else if (offset > line->len)
+               move_cursor(txt_buf, cursor, _KB_ED);
+
+            update = 1;
+         } //if
+         break;
+      }
+
+      case _KB_ENT:
+      case _KB_ENT_N:
+      {
+         //make sure we have clean, initialized lines to work with
+         init_blank_lines(txt_buf, txt_count);
+
+         //cut off the last part of the line into a new one, the lines
+         //in front of the current one move down on their own
+         buf_split_line(txt_buf, txt_count, offset);
+
+         move_cursor(txt_buf, cursor, _KB_HM);       //adjust the cursor
+         move_cursor(txt_buf, cursor, _KB_DN);
+
+         update = 1;
+         break;
+      }
+
+      default:
+      {
+         //check for input characters (also a function involving cursor motion)
+         if (alphanum(key) || (key == _KB_TB))
+         {
+            //make sure we are inserting characters into initialized lines
+            init_blank_lines(txt_buf, txt_count);
+
+            j = (key == _KB_TB) ? _TAB_LEN : 1;      //adjust in case we're tabbing
+            key = (key == _KB_TB) ? ' ' : key;
+
+            for (i = 0; i < j; i++)                  //multiple times if we're tabbing
+            {
+               int offset = cursor->x - cursor->min_x + cursor->buf_x;
+               buf_add_char(txt_buf, txt_count, offset, key);
+
+               move_cursor(txt_buf, cursor, _KB_RT); //move the cursor
+            } //for
+         } //if
+
+         update = 1;   //since something was clearly pressed, need to display the code
+         break;
+      }
+   } //switch
+
+   return(update);
+}
+
+
+int show_bool_query(char *query)
+{
+   //asks a y/n question of the user, returns response
+
+   int ch;
+   _display_move_cursor(0, 42);
+   _display_clear_eol();
+   _display_string(query);
+   _display_dump_bare();
+   forget_frame_row(0);
+
+   while ((ch != 'y') && (ch != 'n') && (ch != 'Y') && (ch != 'N'))
+      ch = get_input();
+
+   _display_move_cursor(0, 42);
+   _display_clear_eol();                        //clear that area
+   _display_dump_bare();
+
+   return((ch == 'Y') || (ch == 'y'));
+}
+
+
+int show_text_query(_cursor_inst *cursor, char *query, char *txt, int size)
+{
+   //asks the user for a line of text on the bottom line, returns FALSE
+   //if they'd rather not say
+
+   int ch, len = 0, event = FALSE;
+
+   txt[0] = '\0';
+
+   while (TRUE)
+   {
+      _display_move_cursor(cursor->max_y + 2, cursor->min_x);
+      _display_clear_eol();
+      _display_string(query);
+      _display_string(txt);
+      _display_dump_bare();
+      forget_frame_row(cursor->max_y + 2);
+
+      ch = get_input();
+
+      if (ch == _KB_EVENT)                      //handled once we're done here
+         event = TRUE;
+      else if ((ch == _KB_ENT) || (ch == _KB_ENT_N) || (ch == '\r'))
+         break;
+      else if ((ch == _KB_ESC) || (ch == _KB_CTRL_C) || (ch == _KB_CTRL_Q))
+      {
+         len = -1;
+         break;
+      }
+      else if (((ch == _KB_BKS) || (ch == 127)) && (len > 0))
+         txt[--len] = '\0';
+      else if ((alphanum(ch)) && (len < size - 1))
+      {
+         txt[len++] = ch;
+         txt[len] = '\0';
+      }
+   } //while
+
+   bg_event = (bg_event || event);
+
+   return(len >= 0);
+}
+
+
+void show_status(_cursor_inst *cursor)
+{
+   //shows the status message right away, while the screen isn't redrawn
+
+   _display_move_cursor(cursor->max_y + 2, cursor->min_x);
+   _display_clear_eol();
+   _display_string(status_msg);
+   _display_dump_bare();
+   forget_frame_row(cursor->max_y + 2);
+}
+
+
+int find_and_show(_txt_buf *txt_buf, _cursor_inst *cursor, int key)
+{
+   //Ctrl-F asks for text to find after the cursor, just enter finds the
+   //last text again; Ctrl-G finds the last text before the cursor. the
+   //cursor goes to it
+
+   _finder fd = {find_txt, 0, (key == _KB_CTRL_G), NULL, 0, 0, 0, 0, cursor, NULL};
+   char query[_FIND_LEN + 16], txt[_FIND_LEN];
+
+   if ((key == _KB_CTRL_F) || (find_txt[0] == '\0'))
+   {
+      sprintf(query, (find_txt[0] != '\0') ? "find [%s]: " : "find: %s", find_txt);
+
+      if (!show_text_query(cursor, query, txt, _FIND_LEN))
+      {
+         status_msg[0] = '\0';
+         return(TRUE);
+      }
+
+      if (txt[0] != '\0')
+         strcpy(find_txt, txt);
+      if (find_txt[0] == '\0')
+         return(TRUE);
+   }
+
+   fd.len = strlen(find_txt);
+
+   return(find_and_move(txt_buf, cursor, &fd));
+}
+
+
+int find_and_move(_txt_buf *txt_buf, _cursor_inst *cursor, _finder *fd)
+{
+   //finds what the finder's looking for from the cursor on, and moves the
+   //cursor to it, bringing it to the middle of the screen if it's far off
+
+   long n = cursor->buf_y + (cursor->y - cursor->min_y);
+   int offset = cursor->x - cursor->min_x + cursor->buf_x;
+   int found;
+   double t;
+
+   found = find_in_buf(txt_buf, fd, &n, &offset);
+   t = get_time() - fd->start;
+   free(fd->flat);
+
+   if (found == _FD_STOPPED)
+      strcpy(status_msg, "find stopped.");
+   else if (found == _FD_NONE)
+      sprintf(status_msg, "not found, %.1f MB in %.3f s", fd->scanned / 1e6, t);
+   else
+   {
+      sprintf(status_msg, "found on line %ld%s, %.1f MB in %.3f s, %.1f MB/s", n + 1,
+              (found == _FD_WRAPPED) ? " (wrapped)" : "", fd->scanned / 1e6, t,
+              fd->scanned / 1e6 / ((t > 0) ? t : 1e-9));
+
+      move_cursor_into_view(txt_buf, cursor, offset, n);
+   }
+
+   return(TRUE);
+}
+
+
+int regex_and_show(_txt_buf *txt_buf, _cursor_inst *cursor, int key)
+{
+   //Ctrl-E asks for a regex to find after the cursor, Ctrl-W for one to
+   //count all through the buffer; just enter for the last one. the cursor
+   //goes to the match found, or the lines of the first matches counted
+   //are listed
+
+   char query[_FIND_LEN + 24], txt[_FIND_LEN];
+   _re_match match[_RE_LIST];
+   _re_scan rs;
+   long found, lines, bytes, i;
+   int threads;
+   double t;
+
+   sprintf(query, (find_re_txt[0] != '\0') ? "%s [%s]: " : "%s: %s",
+           (key == _KB_CTRL_E) ? "regex" : "count regex", find_re_txt);
+
+   if ((!show_text_query(cursor, query, txt, _FIND_LEN)) ||
+       ((txt[0] == '\0') && (find_re_txt[0] == '\0')))
+   {
+      status_msg[0] = '\0';
+      return(TRUE);
+   }
+
+   if (txt[0] != '\0')                          //compiled once, kept for next time
+   {
+      free_regex(find_re);
+      find_re = compile_regex(txt);
+      strcpy(find_re_txt, txt);
+   }
+
+   if (find_re->err != NULL)
+   {
+      snprintf(status_msg, sizeof(status_msg), "regex %s: %s", find_re_txt, find_re->err);
+      return(TRUE);
+   }
+
+   init_re_scan(&rs, find_re);
+
+   if (key == _KB_CTRL_E)
+   {
+      _finder fd = {find_re_txt, strlen(find_re_txt), FALSE, NULL, 0, 0, 0, 0, cursor, &rs};
+
+      find_and_move(txt_buf, cursor, &fd);
+   }
+   else
+   {
+      t = get_time();
+      found = regex_all(txt_buf, find_re, match, &lines, &threads);
+      t = get_time() - t;
+      bytes = (txt_buf->root != NULL) ? txt_buf->root->n_bytes : 0;
+
+      sprintf(status_msg, "%ld found on %ld line%s, %.3f s, %.1f MB/s (%d thread%s)", found, lines,
+              (lines == 1) ? "" : "s", t, bytes / 1e6 / ((t > 0) ? t : 1e-9), threads,
+              (threads == 1) ? "" : "s");
+
+      for (i = 0; (i < found) && (i < _RE_LIST) && (strlen(status_msg) + 28 < sizeof(status_msg)); i++)
+         sprintf(&status_msg[strlen(status_msg)], "%s%ld", (i == 0) ? ": line " : ", ", match[i].n + 1);
+      if (i < found)
+         strcat(status_msg, "...");
+   }
+
+   free_re_scan(&rs);
+
+   return(TRUE);
+}
+
+
+int goto_and_show(_txt_buf *txt_buf, _cursor_inst *cursor)
+{
+   //Ctrl-H asks for a line to go to, the last line if there aren't that
+   //many; the cursor goes to the start of it
+
+   char txt[24], *end;
+   long n;
+
+   if ((!show_text_query(cursor, "go to line: ", txt, sizeof(txt))) || (txt[0] == '\0'))
+   {
+      status_msg[0] = '\0';
+      return(TRUE);
+   }
+
+   if (((n = strtol(txt, &end, 10)) < 1) || (*end != '\0'))
+   {
+      sprintf(status_msg, "no line %s", txt);
+      return(TRUE);
+   }
+
+   wait_for_lines(txt_buf, n - 1);                     //it may just not be loaded yet
+   n = (n > num_lines(txt_buf)) ? num_lines(txt_buf) : n;
+
+   move_cursor_into_view(txt_buf, cursor, 0, n - 1);
+   sprintf(status_msg, "line %ld", n);
+
+   return(TRUE);
+}
+
+
+int replace_and_show(_txt_buf *txt_buf, _cursor_inst *cursor)
+{
+   //Ctrl-R asks for text to replace, just enter for the last text found,
+   //and what to replace it with, then replaces it all through the buffer
+
+   char query[_FIND_LEN + 16], txt[_FIND_LEN], with[_FIND_LEN];
+   long found, lines;
+   int threads;
+   double t;
+
+   sprintf(query, (find_txt[0] != '\0') ? "replace [%s]: " : "replace: %s", find_txt);
+
+   if ((!show_text_query(cursor, query, txt, _FIND_LEN)) ||
+       ((txt[0] == '\0') && (find_txt[0] == '\0')))
+   {
+      status_msg[0] = '\0';
+      return(TRUE);
+   }
+
+   if (txt[0] != '\0')
+      strcpy(find_txt, txt);
+
+   sprintf(query, "replace %s with: ", find_txt);
+   if (!show_text_query(cursor, query, with, _FIND_LEN))
+   {
+      status_msg[0] = '\0';
+      return(TRUE);
+   }
+
+   t = get_time();
+   found = replace_in_buf(txt_buf, find_txt, with, &lines, &threads);
+   t = get_time() - t;
+
+   sprintf(status_msg, "replaced %ld in %ld line%s, %.3f s (%d thread%s)", found, lines,
+           (lines == 1) ? "" : "s", t, threads, (threads == 1) ? "" : "s");
+
+   return(TRUE);
+}
 
-               new_str = malloc((line_len + curlen) * sizeof(char));
-               memset(new_str, 32, line_len + curlen);
-               strncpy(new_str,
-                       txt_buf[(txt_count - 1) / _MAX_LINES][(txt_count - 1) % _MAX_LINES],
-                       line_len - 1);
-               strncpy(&new_str[line_len - 1], txt_buf[txt_c_1][txt_c_2], curlen - 1);
-               new_str[line_len + curlen - 2] = _ENDCHAR;
-               new_str[line_len + curlen - 1] = '\0';
 
-               //empty out the line below
-               free(txt_buf[(txt_count - 1) / _MAX_LINES][(txt_count - 1) % _MAX_LINES]);
+void format_line_num(char *dst, long n, int width)
+{
+   //puts a line number into dst with necessary number of spaces
+   char num[24];
+   int k = format_int(num, n);
+
+   if (k < width)
+      dst += width - k;
+   memcpy(dst, num, k);
+   dst[k] = ':';
+}
 
-               //assign the newly fused line to the line above
-               txt_buf[(txt_count - 1) / _MAX_LINES][(txt_count - 1) % _MAX_LINES] = new_str;
 
-               //move all the lines after this one up
-               for (i = txt_count; i < lst_count; i++)
-                  txt_buf[i / _MAX_LINES][i % _MAX_LINES] =
-                     txt_buf[(i + 1) / _MAX_LINES][(i + 1) % _MAX_LINES];
+int format_int(char *dst, long n)
+{
+   //writes n out in decimal at dst, without a terminating '\0'; returns
+   //how many characters that took
 
-               //clear the last line, no longer needed
-               free(txt_buf[(i + 1) / _MAX_LINES][(i + 1) % _MAX_LINES]);
-            }
+   char num[24];
+   unsigned long u = (n < 0) ? -(unsigned long) n : (unsigned long) n;
+   int k = 0, len;
 
-            //delete a character...
-            if ((offset < curlen) && (offset != 0))
-            {
-               txt_buf[txt_c_1][txt_c_2] =
-                  del_char_from_line(txt_buf[txt_c_1][txt_c_2], offset, curlen);
-               move_cursor(txt_buf, cursor, _KB_LF);
-            }
+   do
+   {
+      num[k++] = '0' + (u % 10);
+      u /= 10;
+   } while (u > 0);
 
-            //or move to the end of the line if we're not in active text
-            if (offset >= curlen)
-               move_cursor(txt_buf, cursor, _KB_ED);
+   if (n < 0)
+      num[k++] = '-';
 
-            update = 1;
-         } //if
-         break;
-      }
+   for (len = k; k > 0; k--)
+      *dst++ = num[k - 1];
 
-      case _KB_ENT:
-      case _KB_ENT_N:
-      {
-         //get the coordinates of the two lines we'll be splitting with an endline
-         long txt_count_new = cursor->buf_y + (cursor->y - cursor->min_y) + 1;
-         long lst_count = num_lines(txt_buf);
-         int txt_c_1_new = txt_count_new / _MAX_LINES;
-         int txt_c_2_new = txt_count_new % _MAX_LINES;
+   return(len);
+}
 
-         int curlen = 0;
-         if ((txt_buf[txt_count / _MAX_LINES] != NULL) &&
-             (txt_buf[txt_count / _MAX_LINES][txt_count % _MAX_LINES] != NULL))
-            curlen = strlen(txt_buf[txt_c_1][txt_c_2]);
 
-         //make sure we have clean, initialized lines to work with
-         init_null_sections(txt_buf, txt_c_1_new, txt_c_2_new);
+int draw_screen_text(_txt_buf *txt_buf, _cursor_inst cursor, int ch, int saved)
+{
+   //draws the active text area of the screen; only the lines changed since
+   //the last time are looked at again, and only what differs on the screen
+   //is written out. scrolling looks at every line again, still only writing
+   //what differs; a resize forgets the frame and draws it all over. the
+   //frame is sized beforehand, drawing allocates nothing
+   int rows = cursor.max_y + 3, cols = cursor.max_x + 2;
+   char *row, num[64];
+   int i, k;
+
+   if ((resize_scr) || (cursor.buf_y != frame_buf_y) || (cursor.buf_x != frame_buf_x) ||
+       (cursor.min_x != frame_min_x))
+   {
+      frame_buf_x = cursor.buf_x;
+      frame_buf_y = cursor.buf_y;
+      frame_min_x = cursor.min_x;
+      dirty_lines(0, LONG_MAX);
+   }
 
-         //move all the lines one down in front of the current one
-         for (i = lst_count; i > txt_count_new; i--)
-            txt_buf[i / _MAX_LINES][i % _MAX_LINES] =
-               txt_buf[(i - 1) / _MAX_LINES][(i - 1) % _MAX_LINES];
+   row = frame_row;
 
-         if (offset >= (curlen - 1))                 //nothing to move
-            txt_buf[txt_c_1_new][txt_c_2_new] = init_new_line();
-         else                                        //stuff to move
-         {
-            //put some text in the new line we emptied out
-            txt_buf[txt_c_1_new][txt_c_2_new] =
-               malloc((curlen - offset + 1) * sizeof(char));
-            strcpy(txt_buf[txt_c_1_new][txt_c_2_new],
-                   &txt_buf[txt_count / _MAX_LINES][txt_count % _MAX_LINES][offset]);
-
-            //cut off the last part of the previous line
-            txt_buf[txt_c_1][txt_c_2] = 
-               realloc(txt_buf[txt_c_1][txt_c_2], (offset + 2) * sizeof(char));
-            txt_buf[txt_c_1][txt_c_2][offset] = _ENDCHAR;
-            txt_buf[txt_c_1][txt_c_2][offset + 1] = '\0';
-         }
+   //output terminal title and display size
+   memset(row, ' ', cols);
+   frame_text(row, 0, "noir terminal editor.");
+
+   strcpy(num, "display: (");
+   k = strlen(num);
+   k += format_int(&num[k], cols);
+   num[k++] = ',';
+   num[k++] = ' ';
+   k += format_int(&num[k], rows);
+   num[k++] = ')';
+   num[k] = '\0';
+   frame_text(row, 22, num);
 
-         move_cursor(txt_buf, cursor, _KB_HM);       //adjust the cursor
-         move_cursor(txt_buf, cursor, _KB_DN);
+   //output if the buffer is synced with the output file
+   if (saved)
+      frame_text(row, 42, "saved.");
 
-         update = 1;
-         break;
-      }
+   //display clipboard function indicator
+   if (cursor.clip_type == 0)
+      frame_text(row, 49, "sel-");
+   else if (cursor.clip_type == 1)
+      frame_text(row, 49, "sel-single");
+   else if (cursor.clip_type == 2)
+      frame_text(row, 49, "sel-multi.");
 
-      default:
-      {
-         //check for input characters (also a function involving cursor motion)
-         if (alphanum(key) || (key == _KB_TB))
-         {
-            //make sure we are inserting characters into initialized lines
-            init_null_sections(txt_buf, txt_c_1, txt_c_2);
+   draw_frame_row(0, row);
 
-            j = (key == _KB_TB) ? _TAB_LEN : 1;      //adjust in case we're tabbing
-            key = (key == _KB_TB) ? ' ' : key;
+   //display the active text display lines that changed
+   for (i = cursor.min_y; i <= cursor.max_y + 1; i++)
+   {
+      long n = cursor.buf_y + i - 1;
+      _line *line;
 
-            for (i = 0; i < j; i++)                  //multiple times if we're tabbing
-            {
-               int offset = cursor->x - cursor->min_x + cursor->buf_x;
-               int curlen = strlen(txt_buf[txt_c_1][txt_c_2]);
+      if ((n < dirty_top) || (n > dirty_end))
+         continue;
 
-               if (offset < curlen)
-                  txt_buf[txt_c_1][txt_c_2] =
-                     add_char_to_line(txt_buf[txt_c_1][txt_c_2], key, offset, curlen);
-               else
-                  txt_buf[txt_c_1][txt_c_2] =
-                     add_char_to_line_end(txt_buf[txt_c_1][txt_c_2], key, offset, curlen);
+      line = get_line(txt_buf, n);
 
-               move_cursor(txt_buf, cursor, _KB_RT); //move the cursor
-            } //for
-         } //if
+      memset(row, ' ', cols);
+      format_line_num(row, n + 1, cursor.min_x - 2);
 
-         update = 1;   //since something was clearly pressed, need to display the code
-         break;
-      }
-   } //switch
+      if ((line != NULL) && (line->len >= cursor.buf_x))
+      {
+         //copy out the visible part of the line and mark its end
+         int width = cols - cursor.min_x;
+         int k = copy_line_text(line, cursor.buf_x, width, &row[cursor.min_x]);
 
-   return(update);
-}
+         if ((cursor.buf_x + k == line->len) && (k < width))
+            row[cursor.min_x + k] = _ENDCHAR;
+      }
 
+      draw_frame_row(i, row);
+   } //for
 
-int show_bool_query(char *query)
-{
-   //asks a y/n question of the user, returns response
+   dirty_top = LONG_MAX;                        //all drawn now
+   dirty_end = -1;
 
-   int ch;
-   _display_move_cursor(0, 42);
-   _display_clear_eol();
-   _display_string(query);
-   _display_dump_bare();
+   //output the value our last character input, and the last message
+   memset(row, ' ', cols);
 
-   while ((ch != 'y') && (ch != 'n') && (ch != 'Y') && (ch != 'N'))
-      ch = get_input();
+   num[format_int(num, ch)] = '\0';
+   frame_text(row, 1, num);
+   frame_text(row, cursor.min_x, status_msg);
 
-   _display_move_cursor(0, 42);
-   _display_clear_eol();                        //clear that area
-   _display_dump_bare();
+   draw_frame_row(cursor.max_y + 2, row);
 
-   return((ch == 'Y') || (ch == 'y'));
+   return(TRUE);     //done successfully
 }
 
 
-void format_line_num_out(long n)
+void size_frame(int rows, int cols)
 {
-   //outputs a line number with necessary number of spaces
-   char *disp_str = malloc(8 * sizeof(char));
+   //makes room for a frame of rows by cols, none of it known to be on the
+   //screen yet; only done when the screen is set up or resized
+
+   int i;
 
-   if (n > ((_MAX_LINES * _MAX_LINES) - 1))     //probably won't be editing files
-      n = n % (_MAX_LINES * _MAX_LINES);        //over 1000000 lines anyway.
+   frame = realloc(frame, rows * (cols + 1));
+   frame_row = realloc(frame_row, cols + 1);
+   frame_rows = rows;
+   frame_cols = cols;
 
-   sprintf(disp_str, "%6ld:", n);
-   _display_string(disp_str);
+   for (i = 0; i < rows; i++)
+      forget_frame_row(i);
 }
 
 
-int draw_screen_text(char ***txt_buf, _cursor_inst cursor, int ch, int saved)
+void draw_frame_row(int row, char *txt)
 {
-   //draws the active text area of the screen
-   char *disp_str = malloc((cursor.max_x * sizeof(char)) + 2);
-   int i;
+   //puts a row of cols characters on the screen, writing out just the spans
+   //where it differs from what's there already, or all of it if that isn't
+   //known; trailing spaces are cleared rather than written. txt needs room
+   //for one more character
 
-   //output terminal title and display size
-   _display_move_cursor(0, 0);
-   _display_clear_eol();
-   _display_string("noir terminal editor.");
-   _display_move_cursor(0, 22);
+   char *old = &frame[row * (frame_cols + 1)], c;
+   int a = 0, b, e, same, end = frame_cols, old_end = frame_cols;
+   int known = old[frame_cols], clear = !known;
 
-   sprintf(disp_str, "display: (%d, %d)", cursor.max_x + 2, cursor.max_y + 3);
-   _display_string(disp_str);
+   while ((end > 0) && (txt[end - 1] == ' '))
+      end--;
+   b = end;
 
-   //output if the buffer is synced with the output file
-   if (saved)
+   if (!clear)                                  //find the span that changed
    {
-      _display_move_cursor(0, 42);
-      _display_string("saved.");
+      while ((old_end > 0) && (old[old_end - 1] == ' '))
+         old_end--;
+      while ((a < end) && (txt[a] == old[a]))
+         a++;
+
+      clear = (old_end > end);
+      if (!clear)
+         while ((b > a) && (txt[b - 1] == old[b - 1]))
+            b--;
+
+      if ((a == b) && (!clear))                 //nothing did
+         return;
    }
 
-   //display clipboard function indicator
-   _display_move_cursor(0, 49);
-   if (cursor.clip_type == 0)
-      _display_string("sel-");
-   else if (cursor.clip_type == 1)
-      _display_string("sel-single");
-   else if (cursor.clip_type == 2)
-      _display_string("sel-multi.");
-
-   //display all the active text display lines
-   for (i = cursor.min_y; i <= cursor.max_y + 1; i++)
+   while (a < b)                                //changes far enough apart go separately
    {
-      long txt_count = cursor.buf_y + i - 1;
-      int txt_c_1 = txt_count / _MAX_LINES;
-      int txt_c_2 = txt_count % _MAX_LINES;
+      for (e = a, same = 0; (e < b) && (same < _SPAN_GAP); e++)
+         same = ((known) && (txt[e] == old[e])) ? same + 1 : 0;
+      e -= same;
+
+      _display_move_cursor(row, a);
+      c = txt[e];
+      txt[e] = '\0';
+      _display_string(&txt[a]);
+      txt[e] = c;
+
+      for (a = e; (a < b) && (txt[a] == old[a]); a++)
+         ;
+   }
 
-      _display_move_cursor(i, 0);
+   if ((clear) && (b < frame_cols))
+   {
+      _display_move_cursor(row, b);
       _display_clear_eol();
-      format_line_num_out((long)(cursor.buf_y + i));
-      _display_move_cursor(i, cursor.min_x);
+   }
 
-      if ((txt_buf[txt_c_1] != NULL) && (txt_buf[txt_c_1][txt_c_2] != NULL))
-         if (strlen(txt_buf[txt_c_1][txt_c_2]) > cursor.buf_x)
-            _display_string(&txt_buf[txt_c_1][txt_c_2][cursor.buf_x]);
-   } //for
+   memcpy(old, txt, frame_cols);
+   old[frame_cols] = TRUE;
+}
 
-   //clean that last terminal blank command line space
-   _display_move_cursor(cursor.max_y + 2, 0);
-   _display_clear_eol();
 
-   //output the value our last character input
-   _display_move_cursor(cursor.max_y + 2, 1);
+void frame_text(char *row, int col, char *txt)
+{
+   //puts txt into a row being drawn from col on, as far as the row goes
 
-   sprintf(disp_str, "%d", ch);
-   _display_string(disp_str);
+   for (; (*txt != '\0') && (col < frame_cols); col++)
+      row[col] = *txt++;
+}
 
-   return(TRUE);     //done successfully
+
+void forget_frame_row(int row)
+{
+   //notes that a row of the screen was drawn over other than by
+   //draw_screen_text(), so it's drawn in full next time
+
+   if ((row >= 0) && (row < frame_rows))
+      frame[row * (frame_cols + 1) + frame_cols] = FALSE;
+}
+
+
+void dirty_lines(long n, long n2)
+{
+   //notes lines n to n2 of the buffer changed, to be drawn again
+
+   dirty_top = (n < dirty_top) ? n : dirty_top;
+   dirty_end = (n2 > dirty_end) ? n2 : dirty_end;
 }
 
 
@@ -1284,6 +6782,7 @@ void* handle_size(int sig)
    _display_exit(); //reset our display
    _display_init();
    resize_scr = 1;
+   wake_input();    //the main loop redraws for it
 
    return ((void*) 0);
 }
@@ -1291,14 +6790,85 @@ void* handle_size(int sig)
 
 int get_input()
 {
-   //gets a character of input
+   //gets a character of input, sleeping until there is one; background work
+   //and resizing wake us when they need us, and are seen to once no key has
+   //come for _INPUT_WAIT ms, so typing isn't held up by them
+
+   int ch;
 
    while (TRUE)
    {
-      int ch = getch();          //wait for the next keypress.
-      if (ch != ERR)
+      if ((ch = poll_input()) != ERR)
          return(ch);
+
+      if (bg_event)
+      {
+         if (wait_input(_INPUT_WAIT))
+            continue;
+
+         bg_event = FALSE;
+         return(_KB_EVENT);
+      }
+
+      wait_input(-1);
+   }
+}
+
+
+int wait_input(int wait)
+{
+   //sleeps until a key is typed or we're woken, or for wait ms, -1 for as
+   //long as it takes; returns TRUE if there's a key
+
+   struct pollfd in[2] = {{STDIN_FILENO, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+   char drain[64];
+
+   if (poll(in, 2, wait) <= 0)
+      return(FALSE);
+
+   if (in[1].revents & POLLIN)                   //emptied, so it can wake us again
+      while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+
+   return((in[0].revents & POLLIN) != 0);
+}
+
+
+void wake_input()
+{
+   //tells the input loop there's background work for it, waking it up if it's
+   //sleeping; safe from other threads and signal handlers
+
+   bg_event = TRUE;
+
+   if (wake_pipe[1] != -1)
+      write(wake_pipe[1], "", 1);
+}
+
+
+void init_wake_pipe()
+{
+   //makes the pipe that wakes the input loop, neither end ever blocks
+
+   if (wake_pipe[0] != -1)
+      return;
+
+   if (pipe(wake_pipe) == 0)
+   {
+      fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+      fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
    }
+   else
+      wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+
+#ifndef _VT_DISPLAY
+
+int poll_input()
+{
+   //gets a character of input if there is one waiting, else ERR
+
+   return(getch());
 }
 
 
@@ -1307,6 +6877,7 @@ void _display_init()
    //display library initialization calls
 
    signal(SIGWINCH, (_handle) handle_size);      //event handling, linux/unix-specific
+   init_wake_pipe();
 
    initscr();                                    //ncurses initialization calls
    //cbreak();
@@ -1314,7 +6885,7 @@ void _display_init()
    noecho();
    keypad(stdscr, TRUE);
    refresh();
-   nodelay(stdscr, TRUE);
+   nodelay(stdscr, TRUE);                        //get_input() does the waiting
 }
 
 
@@ -1365,4 +6936,229 @@ void _display_exit()
    endwin();
 }
 
+#else
+
+
+int poll_input()
+{
+   //gets a character of input if there is one waiting, else ERR
+
+   return(vt_key(0));
+}
+
+
+int vt_key(int wait)
+{
+   //decodes the next key from the terminal, waiting up to wait ms for it;
+   //the escape sequences of the cursor keys come back as ncurses' codes,
+   //ones it doesn't know as ERR, and escape alone as itself
+
+   int ch = vt_byte(wait), n = 0, end;
+
+   if (ch == 127)
+      return(KEY_BACKSPACE);
+   if (ch != _KB_ESC)
+      return(ch);
+
+   if ((ch = vt_byte(_ESC_WAIT)) == ERR)
+      return(_KB_ESC);
+   if ((ch != '[') && (ch != 'O'))            //not a sequence, leave it for next time
+   {
+      vt_in_at--;
+      return(_KB_ESC);
+   }
+
+   while (((end = vt_byte(_ESC_WAIT)) >= '0') && (end <= ';'))
+      n = (end == ';') ? 0 : n * 10 + end - '0';
+
+   switch (end)
+   {
+      case 'A': return(KEY_UP);
+      case 'B': return(KEY_DOWN);
+      case 'C': return(KEY_RIGHT);
+      case 'D': return(KEY_LEFT);
+      case 'H': return(KEY_HOME);
+      case 'F': return(KEY_END);
+      case 'M': return(KEY_ENTER);
+      case '~':
+         if ((n == 1) || (n == 7))
+            return(KEY_HOME);
+         if ((n == 4) || (n == 8))
+            return(KEY_END);
+         if (n == 5)
+            return(KEY_PPAGE);
+         if (n == 6)
+            return(KEY_NPAGE);
+   }
+
+   return(ERR);
+}
+
+
+int vt_byte(int wait)
+{
+   //returns the next byte typed, waiting up to wait ms for it, else ERR;
+   //reads whatever is waiting along with it in one go
+
+   struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+
+   if (vt_in_at == vt_in_len)
+   {
+      vt_in_at = vt_in_len = 0;
+
+      if (poll(&in, 1, wait) <= 0)
+         return(ERR);
+      if ((vt_in_len = read(STDIN_FILENO, vt_in, sizeof(vt_in))) <= 0)
+      {
+         vt_in_len = 0;
+         return(ERR);
+      }
+   }
+
+   return(vt_in[vt_in_at++]);
+}
+
+
+void vt_put(char *txt, long len)
+{
+   //adds to what goes out to the terminal with the next frame
+
+   if (vt_len + len > vt_size)
+   {
+      vt_size = (vt_len + len) * 2;
+      vt_out = realloc(vt_out, vt_size);
+   }
+
+   memcpy(&vt_out[vt_len], txt, len);
+   vt_len += len;
+}
+
+
+void _display_init()
+{
+   //display library initialization calls; the terminal is put in raw mode
+   //and switched to its other screen, output is sent straight to it
+
+   struct termios raw;
+   char *start = "\033[?1049h\033[H\033[2J";
+
+   signal(SIGWINCH, (_handle) handle_size);      //event handling, linux/unix-specific
+   init_wake_pipe();
+
+   if (!vt_on)
+   {
+      tcgetattr(STDIN_FILENO, &vt_saved);
+      vt_on = TRUE;
+   }
+
+   raw = vt_saved;                               //as ncurses' raw() and noecho()
+   raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+   raw.c_iflag &= ~(IXON | BRKINT | PARMRK);
+   raw.c_cc[VMIN] = 1;
+   raw.c_cc[VTIME] = 0;
+   tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+   if (vt_out == NULL)
+   {
+      vt_size = _VT_OUT;
+      vt_out = malloc(vt_size);
+   }
+
+   vt_row = vt_col = -1;
+   write(STDOUT_FILENO, start, strlen(start));
+}
+
+
+void _display_cursor_update(_cursor_inst *cursor)
+{
+   //updates cursor properties from the terminal's size
+
+   struct winsize ws;
+
+   if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0) || (ws.ws_row == 0) || (ws.ws_col == 0))
+   {
+      ws.ws_row = 24;
+      ws.ws_col = 80;
+   }
+
+   cursor->max_y = ws.ws_row;
+   cursor->max_x = vt_cols = ws.ws_col;
+}
+
+
+void _display_move_cursor(int row, int col)
+{
+   //moves cursor to specified coordinates, unless it's there already; along
+   //the same line only the column is given
+
+   char seq[32];
+   int k = 2;
+
+   if ((row == vt_row) && (col == vt_col))
+      return;
+
+   seq[0] = '\033';
+   seq[1] = '[';
+   if (row != vt_row)
+   {
+      k += format_int(&seq[k], row + 1);
+      seq[k++] = ';';
+   }
+   k += format_int(&seq[k], col + 1);
+   seq[k++] = (row != vt_row) ? 'H' : 'G';
+   vt_put(seq, k);
+
+   vt_row = row;
+   vt_col = col;
+}
+
+
+void _display_dump_bare()
+{
+   //flushes changes/refreshes display without cursor update, in one write
+
+   long done = 0, n;
+
+   while (done < vt_len)
+   {
+      if ((n = write(STDOUT_FILENO, &vt_out[done], vt_len - done)) > 0)
+         done += n;
+      else if (errno != EINTR)
+         break;
+   }
+
+   vt_len = 0;
+}
+
+void _display_clear_eol()
+{
+   //clears from cursor position to the end of the line
+
+   vt_put("\033[K", 3);
+}
+
+
+void _display_string(char* str)
+{
+   //outputs supplied string at the current cursor location
+
+   long len = strlen(str);
+
+   vt_put(str, len);
+   vt_col = (vt_col + len < vt_cols) ? vt_col + len : -1;   //past the edge it's not sure
+}
+
+
+void _display_exit()
+{
+   //display library exit calls
+
+   char *end = "\033[?1049l";
+
+   write(STDOUT_FILENO, end, strlen(end));
+   tcsetattr(STDIN_FILENO, TCSANOW, &vt_saved);
+}
+
+#endif
+
 /* eof */
\ No newline at end of file
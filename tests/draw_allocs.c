@@ -0,0 +1,89 @@
+/***********************************************************************************************************
+   draw_allocs.c
+   noir terminal editor, drawing allocation test
+
+   once the first frame has sized everything, drawing the screen mustn't allocate:
+   draw_screen_text(), draw_frame_row() and the output they make all work in buffers
+   size_frame() sets up on a resize. this edits, scrolls and redraws a buffer many
+   times over, counting the allocations noir.c makes while drawing; it fails if any
+   frame after the first made one
+
+   built on the VT display, which needs no terminal, from the top directory:
+   % gcc tests/draw_allocs.c -o draw_allocs -Wall -D_VT_DISPLAY -lpthread && ./draw_allocs
+
+***********************************************************************************************************/
+
+#define _GNU_SOURCE         //as noir.c has it, the headers are included first here
+#include <stdlib.h>
+#include <string.h>
+
+long allocs = 0;                                        //allocations noir.c asked for
+
+void *count_malloc(size_t n)         { allocs++; return(malloc(n)); }
+void *count_calloc(size_t n, size_t k) { allocs++; return(calloc(n, k)); }
+void *count_realloc(void *p, size_t n) { allocs++; return(realloc(p, n)); }
+char *count_strdup(const char *s)    { allocs++; return(strdup(s)); }
+
+#define malloc(n)       count_malloc(n)                 //every call in noir.c is counted
+#define calloc(n, k)    count_calloc(n, k)
+#define realloc(p, n)   count_realloc(p, n)
+#define strdup(s)       count_strdup(s)
+#define main            noir_main
+
+#include "../noir.c"
+
+#undef main
+
+#define    _FRAMES            2000               //frames drawn
+#define    _TEST_LINES        5000               //lines of text to draw
+
+
+int main()
+{
+   _txt_buf *txt_buf = init_txt_buf();
+   _cursor_inst cursor = {0, 0, 0, 0, 0, 0, 0, 0, 4,
+                          {NULL, 0, 0, 0, FALSE, -1}, -1, 0, 0, 0, 0, 0};
+   int keys[] = {'a', 'b', KEY_DOWN, _KB_ENT, 'c', KEY_RIGHT, KEY_NPAGE, KEY_BACKSPACE,
+                 KEY_UP, KEY_END, 'd', KEY_PPAGE, KEY_HOME, KEY_DOWN, KEY_DOWN, 'e'};
+   int nul = open("/dev/null", O_WRONLY), out = dup(STDOUT_FILENO);
+   long i, k, n, drawn = 0, first = 0;
+   char *txt = malloc(_TEST_LINES * 200);
+
+   for (i = 0, n = 0; i < _TEST_LINES; i++)            //lines of all lengths, some past the
+   {                                                   //edge of the screen
+      for (k = (i * 37) % 190; k > 0; k--)
+         txt[n++] = 'a' + (i + k) % 26;
+      txt[n++] = '\n';
+   }
+   buf_insert_text(txt_buf, 0, 0, txt, n);
+   free(txt);
+
+   dup2(nul, STDOUT_FILENO);                           //the frames go nowhere
+   fix_cursor(&cursor);
+
+   for (i = 0; i < _FRAMES; i++)
+   {
+      k = keys[i % (sizeof(keys) / sizeof(int))];      //edits and moves may allocate,
+      move_cursor_advanced(txt_buf, &cursor, k);       //only the drawing is counted
+      move_cursor(txt_buf, &cursor, k);
+      fix_cursor_gutter(&cursor);
+      if (i % 7 == 0)
+         sprintf(status_msg, "frame %ld", i);
+
+      n = allocs;
+      draw_screen_text(txt_buf, cursor, k, (i % 3 == 0));
+      _display_move_cursor(cursor.y, cursor.x);
+      _display_dump_bare();
+
+      if (i == 0)
+         first = allocs - n;
+      else
+         drawn += allocs - n;
+   }
+
+   dup2(out, STDOUT_FILENO);
+   printf("%d frames drawn, %ld allocations for the first, %ld for the rest\n", _FRAMES, first,
+          drawn);
+
+   return((drawn == 0) ? 0 : 1);
+}